@@ -0,0 +1,519 @@
+#include "daemon.h"
+#include "fat.h"
+#include "shell.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define REQUEST_BUFFER_SIZE (sizeof(daemon_request_header) + SHELL_LINE_SIZE)
+
+typedef struct {
+	int fd;
+	char cwd[SHELL_CWD_SIZE]; // client's current directory, it's found by path before every command
+	u8 request_buffer[REQUEST_BUFFER_SIZE];
+	u32 request_size;
+	bool is_waiting; // buffered command can't start yet, it's tried again after a worker finishes
+	bool is_modifying; // buffered command can modify the image
+	pid_t worker_pid; // process running client's command, 0 when there's none
+	int worker_fd; // read end of a pipe, which is hung up when the worker exits
+	FILE *response_file; // command output is kept in a temporary file, so big outputs don't stay in memory
+	u8 response_chunk[DAEMON_RESPONSE_CHUNK_SIZE];
+	u32 response_chunk_size;
+	u32 response_chunk_sent;
+	bool is_closing; // client sent exit, connection is closed once response is sent
+} daemon_client;
+
+static daemon_client s_clients[DAEMON_MAX_CLIENTS];
+static u32 s_clients_count = 0;
+static u32 s_workers_count = 0;
+
+// output of these commands grows with size of a file or directory, so they run in worker processes
+static char *s_worker_commands[] = { "ls", "read" };
+// these commands only read the image, so they can run in the event loop while workers are running,
+// any other command can modify the image and waits until all workers finish
+static char *s_reading_commands[] = { "ls", "read", "cd", "stat", "exit" };
+
+static bool s_set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static bool s_fill_socket_address(struct sockaddr_un *address, char *socket_path) {
+	if (strlen(socket_path) >= sizeof(address->sun_path)) {
+		printf("Socket path is too long\n");
+		return FALSE;
+	}
+
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	strcpy(address->sun_path, socket_path);
+	return TRUE;
+}
+
+static int s_open_listening_socket(char *socket_path) {
+	struct sockaddr_un address;
+	if (!s_fill_socket_address(&address, socket_path)) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	unlink(socket_path); // socket file might be left from the previous run
+	if (bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(fd, DAEMON_MAX_CLIENTS) != 0 || !s_set_nonblocking(fd)) {
+		printf("Can't listen on %s: %s\n", socket_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void s_close_client(u32 client_index) {
+	daemon_client *client = &s_clients[client_index];
+	close(client->fd);
+	if (client->response_file) {
+		fclose(client->response_file);
+	}
+
+	// keep clients array dense, last client takes the place of the closed one
+	s_clients_count--;
+	if (client_index != s_clients_count) {
+		memcpy(client, &s_clients[s_clients_count], sizeof(daemon_client));
+	}
+}
+
+static void s_accept_clients(int listening_fd) {
+	while (1) {
+		int fd = accept(listening_fd, NULL, NULL);
+		if (fd < 0) {
+			return;
+		}
+
+		if (s_clients_count == DAEMON_MAX_CLIENTS || !s_set_nonblocking(fd)) {
+			close(fd);
+			continue;
+		}
+
+		daemon_client *client = &s_clients[s_clients_count++];
+		memset(client, 0, sizeof(daemon_client));
+		client->fd = fd;
+		strcpy(client->cwd, "/");
+	}
+}
+
+static bool s_is_command_in_list(char *command, char **list, u32 list_size) {
+	for (u32 i = 0; i < list_size; i++) {
+		u32 name_length = strlen(list[i]);
+		if (strncmp(command, list[i], name_length) != 0) {
+			continue;
+		}
+
+		char next_char = command[name_length];
+		if (next_char == ' ' || next_char == '\n' || next_char == 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static bool s_is_modification_waiting() {
+	for (u32 i = 0; i < s_clients_count; i++) {
+		if (s_clients[i].is_waiting && s_clients[i].is_modifying) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void s_start_response(daemon_client *client) {
+	fflush(client->response_file);
+	fseeko(client->response_file, 0, SEEK_END);
+	daemon_response_header response_header;
+	response_header.is_closed = client->is_closing;
+	response_header.cwd_length = strlen(client->cwd);
+	response_header.output_length = ftello(client->response_file);
+	rewind(client->response_file);
+
+	// first chunk starts with header and cwd, output follows them as the client reads it
+	memcpy(client->response_chunk, &response_header, sizeof(response_header));
+	memcpy(client->response_chunk + sizeof(response_header), client->cwd, response_header.cwd_length);
+	client->response_chunk_size = sizeof(response_header) + response_header.cwd_length;
+	client->response_chunk_size += fread(client->response_chunk + client->response_chunk_size, 1, DAEMON_RESPONSE_CHUNK_SIZE - client->response_chunk_size, client->response_file);
+	client->response_chunk_sent = 0;
+}
+
+// another client could have removed the directory, or replaced it with a new one, so cluster of the directory isn't kept
+static void s_restore_client_directory(daemon_client *client) {
+	u32 directory_cluster = fat_find_directory(client->cwd);
+	if (!directory_cluster) {
+		fprintf(client->response_file, "Current directory was removed, returning to /\n");
+		strcpy(client->cwd, "/");
+		directory_cluster = fat_find_directory(client->cwd);
+	}
+
+	if (fat_get_current_directory() == directory_cluster) {
+		return;
+	}
+
+	// relative commands of different clients are recorded into the same trace,
+	// so the switch is recorded as an absolute cd, otherwise replay would run them in wrong directories
+	if (trace_is_recording()) {
+		fat_change_current_directory(client->cwd);
+	} else {
+		fat_set_current_directory(directory_cluster);
+	}
+}
+
+// worker is a forked copy of the daemon, it sees FAT as it was at the start and writes output into the response file,
+// returns FALSE if worker can't be started
+static bool s_start_worker(daemon_client *client, char *command) {
+	int pipe_fds[2];
+	if (pipe(pipe_fds) != 0) {
+		return FALSE;
+	}
+
+	fflush(NULL); // worker flushes the response file, so nothing buffered by the daemon should be left in it
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return FALSE;
+	}
+
+	if (pid == 0) {
+		close(pipe_fds[0]);
+		// image is accessed with pread/pwrite, so the shared descriptor has no offset to race on
+		shell_execute_command(command, client->cwd, client->response_file, TRUE);
+		fflush(client->response_file);
+		_exit(0); // streams of the daemon are shared with the worker, so they shouldn't be flushed again
+	}
+
+	close(pipe_fds[1]);
+	client->worker_pid = pid;
+	client->worker_fd = pipe_fds[0];
+	s_workers_count++;
+	return TRUE;
+}
+
+static void s_finish_worker(daemon_client *client) {
+	waitpid(client->worker_pid, NULL, 0);
+	close(client->worker_fd);
+	client->worker_pid = 0;
+	s_workers_count--;
+	s_start_response(client);
+}
+
+// starts buffered command, unless it has to wait for workers
+// returns FALSE when client should be disconnected
+static bool s_start_request(daemon_client *client) {
+	daemon_request_header *request_header = (daemon_request_header*) client->request_buffer;
+	u32 request_size = sizeof(daemon_request_header) + request_header->command_length;
+
+	char command[SHELL_LINE_SIZE];
+	memcpy(command, client->request_buffer + sizeof(daemon_request_header), request_header->command_length);
+	command[request_header->command_length] = 0;
+
+	// workers see FAT as it was when they started, so modifications wait until all of them finish,
+	// and new workers don't start while a modification is waiting
+	// commands of workers wouldn't get into the trace, so everything runs in the event loop while recording
+	bool is_worker_command = !trace_is_recording() && s_is_command_in_list(command, s_worker_commands, sizeof(s_worker_commands) / sizeof(s_worker_commands[0]));
+	client->is_modifying = !s_is_command_in_list(command, s_reading_commands, sizeof(s_reading_commands) / sizeof(s_reading_commands[0]));
+	if (client->is_modifying) {
+		client->is_waiting = s_workers_count > 0;
+	} else {
+		client->is_waiting = is_worker_command && (s_workers_count == DAEMON_MAX_WORKERS || s_is_modification_waiting());
+	}
+	if (client->is_waiting) {
+		return TRUE;
+	}
+
+	// remove started request, next one might be already buffered
+	client->request_size -= request_size;
+	memmove(client->request_buffer, client->request_buffer + request_size, client->request_size);
+
+	client->response_file = tmpfile();
+	if (!client->response_file) {
+		return FALSE;
+	}
+
+	fat_set_output(client->response_file);
+	s_restore_client_directory(client);
+	if (!is_worker_command || !s_start_worker(client, command)) {
+		client->is_closing = !shell_execute_command(command, client->cwd, client->response_file, TRUE);
+		s_start_response(client);
+	}
+	fat_set_output(stdout);
+	return TRUE;
+}
+
+static void s_start_waiting_requests() {
+	// iterate backwards, so closing a client doesn't move clients that weren't handled yet
+	for (s32 i = s_clients_count - 1; i >= 0; i--) {
+		if (s_clients[i].is_waiting && !s_start_request(&s_clients[i])) {
+			s_close_client(i);
+		}
+	}
+}
+
+static bool s_has_complete_request(daemon_client *client) {
+	if (client->request_size < sizeof(daemon_request_header)) {
+		return FALSE;
+	}
+
+	daemon_request_header *request_header = (daemon_request_header*) client->request_buffer;
+	return client->request_size >= sizeof(daemon_request_header) + request_header->command_length;
+}
+
+// returns FALSE when client should be disconnected
+static bool s_handle_readable(daemon_client *client) {
+	ssize_t received = recv(client->fd, client->request_buffer + client->request_size, REQUEST_BUFFER_SIZE - client->request_size, 0);
+	if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		return FALSE;
+	}
+	if (received > 0) {
+		client->request_size += received;
+	}
+
+	if (client->request_size >= sizeof(daemon_request_header)) {
+		daemon_request_header *request_header = (daemon_request_header*) client->request_buffer;
+		if (request_header->command_length >= SHELL_LINE_SIZE) {
+			return FALSE; // malformed request
+		}
+	}
+
+	if (s_has_complete_request(client)) {
+		return s_start_request(client);
+	}
+
+	return TRUE;
+}
+
+// returns FALSE when client should be disconnected
+static bool s_handle_writable(daemon_client *client) {
+	u32 remaining_size = client->response_chunk_size - client->response_chunk_sent;
+	ssize_t sent = send(client->fd, client->response_chunk + client->response_chunk_sent, remaining_size, MSG_NOSIGNAL);
+	if (sent < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+
+	client->response_chunk_sent += sent;
+	if (client->response_chunk_sent < client->response_chunk_size) {
+		return TRUE;
+	}
+
+	client->response_chunk_size = fread(client->response_chunk, 1, DAEMON_RESPONSE_CHUNK_SIZE, client->response_file);
+	client->response_chunk_sent = 0;
+	if (client->response_chunk_size > 0) {
+		return TRUE;
+	}
+
+	fclose(client->response_file);
+	client->response_file = NULL;
+	if (client->is_closing) {
+		return FALSE;
+	}
+
+	if (s_has_complete_request(client)) {
+		return s_start_request(client);
+	}
+
+	return TRUE;
+}
+
+static bool s_serve_image(char *image_path, char *socket_path, bool is_direct_io) {
+	if (!fat_load_from_file(image_path, is_direct_io)) {
+		printf("Can't open %s\n", image_path);
+		return FALSE;
+	}
+
+	int listening_fd = s_open_listening_socket(socket_path);
+	if (listening_fd < 0) {
+		return FALSE;
+	}
+
+	printf("Serving %s on %s\n", image_path, socket_path);
+	fflush(stdout);
+
+	// clients are served by a single event loop, because filesystem state isn't shared between threads,
+	// only commands with big outputs run in forked workers
+	struct pollfd poll_fds[DAEMON_MAX_CLIENTS + 1];
+	while (1) {
+		u32 polled_clients_count = s_clients_count;
+		for (u32 i = 0; i < polled_clients_count; i++) {
+			daemon_client *client = &s_clients[i];
+			// while client waits for its worker or for its turn, only hang up is watched
+			poll_fds[i].fd = client->worker_pid ? client->worker_fd : client->fd;
+			if (client->worker_pid || client->is_waiting) {
+				poll_fds[i].events = 0;
+			} else {
+				poll_fds[i].events = client->response_file ? POLLOUT : POLLIN;
+			}
+			poll_fds[i].revents = 0;
+		}
+		poll_fds[polled_clients_count].fd = listening_fd;
+		poll_fds[polled_clients_count].events = POLLIN;
+		poll_fds[polled_clients_count].revents = 0;
+
+		if (poll(poll_fds, polled_clients_count + 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		// iterate backwards, so closing a client doesn't move clients that weren't handled yet
+		for (s32 i = polled_clients_count - 1; i >= 0; i--) {
+			short revents = poll_fds[i].revents;
+			if (!revents) {
+				continue;
+			}
+
+			daemon_client *client = &s_clients[i];
+			bool keep_client = TRUE;
+			if (client->worker_pid) {
+				s_finish_worker(client);
+			} else if (revents & POLLOUT) {
+				keep_client = s_handle_writable(client);
+			} else if (revents & POLLIN) {
+				keep_client = s_handle_readable(client);
+			} else {
+				keep_client = FALSE; // POLLERR or POLLHUP
+			}
+
+			if (!keep_client) {
+				s_close_client(i);
+			}
+		}
+		s_start_waiting_requests();
+
+		if (poll_fds[polled_clients_count].revents & POLLIN) {
+			s_accept_clients(listening_fd);
+		}
+	}
+
+	close(listening_fd);
+	unlink(socket_path);
+	return FALSE;
+}
+
+bool daemon_serve(char **image_paths, char **socket_paths, u32 images_count, bool is_direct_io) {
+	if (images_count == 1) {
+		return s_serve_image(image_paths[0], socket_paths[0], is_direct_io);
+	}
+
+	// filesystem state is global, so every image is served by its own process
+	for (u32 i = 0; i < images_count; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			exit(s_serve_image(image_paths[i], socket_paths[i], is_direct_io) ? 0 : 1);
+		} else if (pid < 0) {
+			printf("Can't start server for %s\n", image_paths[i]);
+		}
+	}
+
+	// servers run until they fail, daemon exits once all of them are gone
+	while (wait(NULL) > 0) {
+	}
+	return FALSE;
+}
+
+static bool s_send_all(int fd, void *data, u32 size) {
+	u8 *data_ptr = data;
+	while (size > 0) {
+		ssize_t sent = send(fd, data_ptr, size, MSG_NOSIGNAL);
+		if (sent <= 0) {
+			return FALSE;
+		}
+		data_ptr += sent;
+		size -= sent;
+	}
+	return TRUE;
+}
+
+static bool s_recv_all(int fd, void *data, u32 size) {
+	u8 *data_ptr = data;
+	while (size > 0) {
+		ssize_t received = recv(fd, data_ptr, size, 0);
+		if (received <= 0) {
+			return FALSE;
+		}
+		data_ptr += received;
+		size -= received;
+	}
+	return TRUE;
+}
+
+bool daemon_run_client(char *socket_path) {
+	struct sockaddr_un address;
+	if (!s_fill_socket_address(&address, socket_path)) {
+		return FALSE;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+		printf("Can't connect to %s\n", socket_path);
+		return FALSE;
+	}
+
+	char cwd[SHELL_CWD_SIZE] = "/";
+	u8 request[REQUEST_BUFFER_SIZE];
+	char *command = (char*) request + sizeof(daemon_request_header);
+	while (1) {
+		printf("%s>", cwd);
+		fflush(stdout);
+		if (!fgets(command, SHELL_LINE_SIZE, stdin)) {
+			break;
+		}
+
+		daemon_request_header *request_header = (daemon_request_header*) request;
+		request_header->command_length = strlen(command);
+		if (!s_send_all(fd, request, sizeof(daemon_request_header) + request_header->command_length)) {
+			printf("Connection lost\n");
+			break;
+		}
+
+		daemon_response_header response_header;
+		if (!s_recv_all(fd, &response_header, sizeof(response_header)) || response_header.cwd_length >= SHELL_CWD_SIZE) {
+			printf("Connection lost\n");
+			break;
+		}
+
+		bool received = s_recv_all(fd, cwd, response_header.cwd_length);
+		cwd[response_header.cwd_length] = 0;
+
+		// output can be as big as a whole file, so it's printed chunk by chunk
+		u8 output_chunk[DAEMON_RESPONSE_CHUNK_SIZE];
+		u64 remaining_size = response_header.output_length;
+		while (received && remaining_size > 0) {
+			u32 chunk_size = remaining_size > DAEMON_RESPONSE_CHUNK_SIZE ? DAEMON_RESPONSE_CHUNK_SIZE : remaining_size;
+			received = s_recv_all(fd, output_chunk, chunk_size);
+			if (received) {
+				fwrite(output_chunk, 1, chunk_size, stdout);
+				remaining_size -= chunk_size;
+			}
+		}
+
+		if (!received) {
+			printf("Connection lost\n");
+			break;
+		}
+		if (response_header.is_closed) {
+			break;
+		}
+	}
+
+	close(fd);
+	return TRUE;
+}
@@ -0,0 +1,27 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "types.h"
+
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_MAX_WORKERS 4 // max count of commands running in forked workers at once
+#define DAEMON_MAX_IMAGES 16
+#define DAEMON_RESPONSE_CHUNK_SIZE (64 * 1024) // responses are sent and received in chunks of this size
+
+// every message starts with a header, followed by its payload
+// request payload is a shell command line
+typedef struct {
+	u16 command_length;
+} __attribute__((packed)) daemon_request_header;
+
+// response payload is client's current working directory followed by command output
+typedef struct {
+	u8 is_closed; // set when command ended the session (exit)
+	u16 cwd_length;
+	u64 output_length; // read of a 4 GiB file doesn't fit into u32 with the trailing new line
+} __attribute__((packed)) daemon_response_header;
+
+bool daemon_serve(char **image_paths, char **socket_paths, u32 images_count, bool is_direct_io);
+bool daemon_run_client(char *socket_path);
+
+#endif
@@ -1,18 +1,189 @@
 #include "directory.h"
 #include "fat32_dir_entry.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
 
-static void s_convert_utf16_to_ascii(char *ascii, u16 *utf16, int count) {
-	for (int i = 0; i < count; i++) {
-		if (utf16[i] == 0xFFFF) {
-			break;
+#define LFN_CHARS_PER_ENTRY 13
+#define MAX_LFN_ENTRIES ((MAX_FILENAME_LEN + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY)
+#define ASCII_MASK_X4 0xFF80FF80FF80FF80ULL // any bit set means one of 4 UTF-16 characters isn't ASCII
+
+static u32 s_encode_utf8(u32 code_point, u8 *out) {
+	if (code_point < 0x80) {
+		out[0] = code_point;
+		return 1;
+	} else if (code_point < 0x800) {
+		out[0] = 0xC0 | (code_point >> 6);
+		out[1] = 0x80 | (code_point & 0x3F);
+		return 2;
+	} else if (code_point < 0x10000) {
+		out[0] = 0xE0 | (code_point >> 12);
+		out[1] = 0x80 | ((code_point >> 6) & 0x3F);
+		out[2] = 0x80 | (code_point & 0x3F);
+		return 3;
+	}
+
+	out[0] = 0xF0 | (code_point >> 18);
+	out[1] = 0x80 | ((code_point >> 12) & 0x3F);
+	out[2] = 0x80 | ((code_point >> 6) & 0x3F);
+	out[3] = 0x80 | (code_point & 0x3F);
+	return 4;
+}
+
+// returns how many bytes were consumed, 0 if sequence isn't valid UTF-8
+static u32 s_decode_utf8(u8 *in, u32 *out_code_point) {
+	u32 sequence_length;
+	u32 code_point;
+	if (in[0] < 0x80) {
+		*out_code_point = in[0];
+		return 1;
+	} else if ((in[0] & 0xE0) == 0xC0) {
+		sequence_length = 2;
+		code_point = in[0] & 0x1F;
+	} else if ((in[0] & 0xF0) == 0xE0) {
+		sequence_length = 3;
+		code_point = in[0] & 0x0F;
+	} else if ((in[0] & 0xF8) == 0xF0) {
+		sequence_length = 4;
+		code_point = in[0] & 0x07;
+	} else {
+		return 0;
+	}
+
+	for (u32 i = 1; i < sequence_length; i++) {
+		if ((in[i] & 0xC0) != 0x80) {
+			return 0;
+		}
+		code_point = (code_point << 6) | (in[i] & 0x3F);
+	}
+
+	*out_code_point = code_point;
+	return sequence_length;
+}
+
+// out_utf8 should have space for 3 bytes per UTF-16 character plus NULL terminating character
+static void s_convert_utf16_to_utf8(char *out_utf8, u16 *utf16, u32 count) {
+	u8 *out = (u8*) out_utf8;
+	u32 i = 0;
+	while (i < count) {
+		// most names are ASCII, so 4 characters are checked and converted at once
+		if (i + 4 <= count) {
+			u64 characters;
+			memcpy(&characters, utf16 + i, sizeof(characters));
+			if (!(characters & ASCII_MASK_X4)) {
+				out[0] = utf16[i];
+				out[1] = utf16[i + 1];
+				out[2] = utf16[i + 2];
+				out[3] = utf16[i + 3];
+				out += 4;
+				i += 4;
+				continue;
+			}
+		}
+
+		u32 code_point = utf16[i++];
+		bool is_high_surrogate = code_point >= 0xD800 && code_point < 0xDC00;
+		if (is_high_surrogate && i < count && utf16[i] >= 0xDC00 && utf16[i] < 0xE000) {
+			code_point = 0x10000 + ((code_point - 0xD800) << 10) + (utf16[i++] - 0xDC00);
 		}
-		ascii[i] = utf16[i] > 127 ? '?' : utf16[i];
+		out += s_encode_utf8(code_point, out);
+	}
+	*out = 0;
+}
+
+// returns count of UTF-16 characters, invalid UTF-8 bytes are kept as is
+static u32 s_convert_utf8_to_utf16(char *utf8, u16 *out_utf16, u32 max_count) {
+	u8 *in = (u8*) utf8;
+	u32 count = 0;
+	while (*in && count < max_count) {
+		u32 code_point;
+		u32 sequence_length = s_decode_utf8(in, &code_point);
+		if (!sequence_length) {
+			code_point = *in;
+			sequence_length = 1;
+		}
+		in += sequence_length;
+
+		if (code_point >= 0x10000) {
+			if (count + 2 > max_count) {
+				break;
+			}
+			code_point -= 0x10000;
+			out_utf16[count++] = 0xD800 + (code_point >> 10);
+			out_utf16[count++] = 0xDC00 + (code_point & 0x3FF);
+		} else {
+			out_utf16[count++] = code_point;
+		}
+	}
+	return count;
+}
+
+// simple case folding for latin, greek and cyrillic scripts, other characters are left as is
+static u32 s_fold_code_point(u32 code_point) {
+	if (code_point < 0x80) {
+		return tolower(code_point);
+	} else if (code_point >= 0xC0 && code_point <= 0xDE && code_point != 0xD7) {
+		return code_point + 0x20;
+	} else if (code_point >= 0x100 && code_point <= 0x17F) {
+		// latin extended-A, pairs of upper and lower case letters
+		bool is_odd_pair = (code_point >= 0x139 && code_point <= 0x148) || (code_point >= 0x179 && code_point <= 0x17E);
+		if (code_point == 0x178) {
+			return 0xFF;
+		} else if (is_odd_pair) {
+			return code_point + (code_point & 1);
+		} else if (code_point != 0x138 && code_point != 0x149 && code_point != 0x17F) {
+			return code_point | 1;
+		}
+	} else if (code_point >= 0x391 && code_point <= 0x3AB && code_point != 0x3A2) {
+		return code_point + 0x20;
+	} else if (code_point >= 0x400 && code_point <= 0x40F) {
+		return code_point + 0x50;
+	} else if (code_point >= 0x410 && code_point <= 0x42F) {
+		return code_point + 0x20;
+	} else if ((code_point >= 0x460 && code_point <= 0x481) || (code_point >= 0x48A && code_point <= 0x4BF)) {
+		return code_point | 1;
+	} else if (code_point >= 0xFF21 && code_point <= 0xFF3A) {
+		return code_point + 0x20; // fullwidth latin
+	}
+
+	return code_point;
+}
+
+static bool s_is_utf8_continuation_byte(char c) {
+	return ((u8) c & 0xC0) == 0x80;
+}
+
+// non ASCII characters aren't allowed in short names, they're replaced with '_'
+static char s_to_sfn_char(char c) {
+	return (u8) c < 0x80 ? toupper(c) : '_';
+}
+
+static char *s_sorted_listing_names = NULL; // qsort doesn't pass any context to comparison function
+
+// when listing is sorted, case folded key is stored right after the name, like lookups use
+static char* s_get_listing_entry_key(directory_listing_entry *entry) {
+	return s_sorted_listing_names + entry->name_offset + entry->name_length + 1;
+}
+
+static int s_compare_listing_entries(const void *first, const void *second) {
+	directory_listing_entry *first_entry = (directory_listing_entry*) first;
+	directory_listing_entry *second_entry = (directory_listing_entry*) second;
+	int result = strcmp(s_get_listing_entry_key(first_entry), s_get_listing_entry_key(second_entry));
+	if (result) {
+		return result;
 	}
+	return strcmp(s_sorted_listing_names + first_entry->name_offset, s_sorted_listing_names + second_entry->name_offset);
+}
+
+static u32 s_hash_key(char *key) {
+	u32 hash = 2166136261u; // FNV-1a
+	for (u8 *key_ptr = (u8*) key; *key_ptr; key_ptr++) {
+		hash = (hash ^ *key_ptr) * 16777619u;
+	}
+	return hash;
 }
 
 static int s_read_lfn(long_dir_entry *long_entry, char *out_long_name) {
@@ -23,19 +194,39 @@ static int s_read_lfn(long_dir_entry *long_entry, char *out_long_name) {
 
 	u8 checksum = long_entry->checksum;
 	int long_entries_count = long_entry->ord ^ LAST_LONG_ENTRY;
+	if (long_entries_count == 0 || long_entries_count > MAX_LFN_ENTRIES) {
+		out_long_name[0] = 0;
+		return 1;
+	}
+
+	u16 utf16_name[MAX_LFN_ENTRIES * LFN_CHARS_PER_ENTRY];
 	for (u8 ord = long_entries_count; ord > 0; long_entry++, ord--) {
 		if ((long_entry->ord & 0b111111) != ord || checksum != long_entry->checksum) {
 			out_long_name[0] = 0; // NULL terminate string because lfn is damaged
 			return (long_entries_count - ord + 1); // and return how many entries was already processed
 		}
 
-		char *current_part_ptr = out_long_name + 13 * (ord - 1);
-		s_convert_utf16_to_ascii(current_part_ptr, long_entry->name1, 5);
-		s_convert_utf16_to_ascii(current_part_ptr + 5, long_entry->name2, 6);
-		s_convert_utf16_to_ascii(current_part_ptr + 11, long_entry->name3, 2);
+		u16 *current_part_ptr = utf16_name + LFN_CHARS_PER_ENTRY * (ord - 1);
+		// name parts aren't aligned inside packed entry, so they're copied byte by byte
+		memcpy(current_part_ptr, (u8*) long_entry + offsetof(long_dir_entry, name1), 5 * sizeof(u16));
+		memcpy(current_part_ptr + 5, (u8*) long_entry + offsetof(long_dir_entry, name2), 6 * sizeof(u16));
+		memcpy(current_part_ptr + 11, (u8*) long_entry + offsetof(long_dir_entry, name3), 2 * sizeof(u16));
+	}
+
+	// name ends with NULL character followed by 0xFFFF padding, unless it fills all entries
+	u32 name_length = 0;
+	u32 max_name_length = LFN_CHARS_PER_ENTRY * long_entries_count;
+	while (name_length < max_name_length && utf16_name[name_length] && utf16_name[name_length] != 0xFFFF) {
+		name_length++;
 	}
 
-	out_long_name[13 * long_entries_count] = 0; // add NULL terminating character in case LFN doesn't have one
+	// last entry can hold up to 260 characters, but longer names would overflow buffers sized for MAX_FILENAME_LEN
+	if (name_length > MAX_FILENAME_LEN) {
+		out_long_name[0] = 0;
+		return long_entries_count;
+	}
+
+	s_convert_utf16_to_utf8(out_long_name, utf16_name, name_length);
 	return long_entries_count;
 }
 
@@ -68,33 +259,33 @@ static u8 s_sfn_checksum(char *name) {
 }
 
 static u8 s_calculate_lfn_entries_count(char *name) {
-	if (!name[0]) {
+	u16 utf16_name[MAX_FILENAME_LEN];
+	u32 name_length = s_convert_utf8_to_utf16(name, utf16_name, MAX_FILENAME_LEN);
+	if (!name_length) {
 		return 1;
 	}
-	return 1 + (strlen(name) - 1) / 13;
+	return 1 + (name_length - 1) / LFN_CHARS_PER_ENTRY;
 }
 
-static void s_fill_long_dir_entry(long_dir_entry *long_entry, u8 ord, u8 checksum, char *name) {
+static void s_fill_long_dir_entry(long_dir_entry *long_entry, u8 ord, u8 checksum, u16 *name, u32 name_length) {
 	long_entry->ord = ord;
 	long_entry->attributes = ATTR_LONG_NAME;
 	long_entry->type = 0;
 	long_entry->checksum = checksum;
 	long_entry->first_cluster_low = 0;
 
-	u32 name_offset = ((ord & 0b111111) - 1) * 13;
-	name += name_offset;
+	u32 name_offset = ((ord & 0b111111) - 1) * LFN_CHARS_PER_ENTRY;
 
-	bool str_ended = FALSE;
-	for (int i = 0; i < 13; i++) {
+	for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+		u32 name_position = name_offset + i;
 		u16 c;
 
-		if (str_ended) {
-			c = 0xFFFF;
+		if (name_position < name_length) {
+			c = name[name_position];
+		} else if (name_position == name_length) {
+			c = 0;
 		} else {
-			if (name[i] == 0) {
-				str_ended = TRUE;
-			}
-			c = name[i];
+			c = 0xFFFF;
 		}
 
 		if (i < 5) {
@@ -140,6 +331,7 @@ bool directory_next_file(void *ptr, u32 size, u32 *out_current_entry_index, file
 			continue;
 		}
 
+		u32 first_entry_index = *out_current_entry_index;
 		if ((current_entry->attributes & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME) {
 			long_dir_entry *long_entry = (long_dir_entry*) current_entry;
 			int long_entry_count = s_read_lfn(long_entry, out_file_info->filename);
@@ -158,6 +350,8 @@ bool directory_next_file(void *ptr, u32 size, u32 *out_current_entry_index, file
 		out_file_info->first_cluster = (current_entry->first_cluster_high << 16) | current_entry->first_cluster_low;
 		out_file_info->is_directory = current_entry->attributes & ATTR_DIRECTORY;
 		*out_current_entry_index += 1;
+		out_file_info->entry_index = first_entry_index;
+		out_file_info->entries_count = *out_current_entry_index - first_entry_index;
 
 		return TRUE;
 	}
@@ -165,15 +359,284 @@ bool directory_next_file(void *ptr, u32 size, u32 *out_current_entry_index, file
 	return FALSE;
 }
 
-bool directory_find_file(void *ptr, u32 size, file_info *out_file_info, char* name) {
-	u32 current_entry_index = 0;
-	while (directory_next_file(ptr, size, &current_entry_index, out_file_info)) {
-		if (strcmp(name, out_file_info->filename) == 0) {
-			return TRUE;
+void directory_read_listing(void *ptr, u32 size, directory_listing_options *options, directory_listing *out_listing) {
+	// entries part of the arena has fixed size, because count of files is known before decoding,
+	// names part is placed after it and arena is reallocated when names don't fit
+	u32 max_entries_count = directory_count_files(ptr, size);
+	u32 entries_size = max_entries_count * sizeof(directory_listing_entry);
+	u32 names_capacity = max_entries_count * 16 + 1;
+	u8 *arena = malloc(entries_size + names_capacity);
+	u32 names_size = 0;
+	u32 entries_count = 0;
+
+	file_info fi;
+	u32 entry_index = 0;
+	while (directory_next_file(ptr, size, &entry_index, &fi)) {
+		u32 name_length = strlen(fi.filename);
+		// folded key is never longer than the name
+		u32 name_size = options->sort_by_name ? (name_length + 1) * 2 : name_length + 1;
+		if (names_size + name_size > names_capacity) {
+			names_capacity = (names_size + name_size) * 2;
+			arena = realloc(arena, entries_size + names_capacity);
 		}
+
+		directory_listing_entry *entry = (directory_listing_entry*) arena + entries_count++;
+		entry->name_offset = names_size;
+		entry->name_length = name_length;
+		entry->file_size = fi.file_size;
+		entry->first_cluster = fi.first_cluster;
+		entry->is_directory = fi.is_directory;
+
+		char *name_ptr = (char*) arena + entries_size + names_size;
+		memcpy(name_ptr, fi.filename, name_length + 1);
+		if (options->sort_by_name) {
+			directory_fold_name(fi.filename, name_ptr + name_length + 1);
+		}
+		names_size += name_size;
 	}
 
-	return FALSE;
+	out_listing->entries = (directory_listing_entry*) arena;
+	out_listing->names = (char*) arena + entries_size;
+	out_listing->names_size = names_size;
+
+	if (options->sort_by_name) {
+		s_sorted_listing_names = out_listing->names;
+		qsort(out_listing->entries, entries_count, sizeof(directory_listing_entry), s_compare_listing_entries);
+	}
+
+	u32 first_entry = options->page_offset < entries_count ? options->page_offset : entries_count;
+	u32 page_entries_count = entries_count - first_entry;
+	if (options->page_size && options->page_size < page_entries_count) {
+		page_entries_count = options->page_size;
+	}
+
+	memmove(out_listing->entries, out_listing->entries + first_entry, page_entries_count * sizeof(directory_listing_entry));
+	out_listing->entries_count = page_entries_count;
+}
+
+void directory_free_listing(directory_listing *listing) {
+	free(listing->entries); // entries are at the start of the arena
+	listing->entries = NULL;
+	listing->names = NULL;
+	listing->entries_count = 0;
+	listing->names_size = 0;
+}
+
+void directory_fold_name(char *name, char *out_key) {
+	// folded characters take the same amount of bytes, so key is never longer than name
+	u8 *in = (u8*) name;
+	u8 *out = (u8*) out_key;
+	while (*in) {
+		u32 code_point;
+		u32 sequence_length = s_decode_utf8(in, &code_point);
+		if (!sequence_length) {
+			*out++ = *in++;
+			continue;
+		}
+
+		in += sequence_length;
+		out += s_encode_utf8(s_fold_code_point(code_point), out);
+	}
+	*out = 0;
+}
+
+// returns slot with the same key, or empty slot where the key should be added
+static u32 s_find_index_slot(directory_index *index, u32 hash, char *key) {
+	u32 slot_index = hash & (index->slots_count - 1);
+	while (index->slots[slot_index].key_offset != INDEX_SLOT_EMPTY) {
+		directory_index_slot *slot = &index->slots[slot_index];
+		if (slot->hash == hash && strcmp(index->keys + slot->key_offset, key) == 0) {
+			break;
+		}
+		slot_index = (slot_index + 1) & (index->slots_count - 1);
+	}
+	return slot_index;
+}
+
+static void s_allocate_index_slots(directory_index *index, u32 slots_count) {
+	index->slots_count = slots_count;
+	index->slots = malloc(slots_count * sizeof(directory_index_slot));
+	for (u32 i = 0; i < slots_count; i++) {
+		index->slots[i].key_offset = INDEX_SLOT_EMPTY;
+	}
+}
+
+static void s_add_index_key(directory_index *index, u32 slot_index, u32 hash, char *key, u32 entry_index) {
+	u32 key_size = strlen(key) + 1;
+	if (index->keys_size + key_size > index->keys_capacity) {
+		index->keys_capacity = (index->keys_size + key_size) * 2;
+		index->keys = realloc(index->keys, index->keys_capacity);
+	}
+	memcpy(index->keys + index->keys_size, key, key_size);
+
+	directory_index_slot *slot = &index->slots[slot_index];
+	slot->hash = hash;
+	slot->entry_index = entry_index;
+	slot->key_offset = index->keys_size;
+	index->keys_size += key_size;
+	index->keys_count++;
+}
+
+// runs of deleted entries are collected, so new entries can be placed without scanning the directory
+static void s_build_free_entries_map(void *ptr, u32 size, directory_index *out_index) {
+	u32 free_runs_capacity = 0;
+	out_index->free_runs = NULL;
+	out_index->free_runs_count = 0;
+
+	dir_entry *entries = ptr;
+	u32 entries_count = size / sizeof(dir_entry);
+	u32 run_start = INDEX_SLOT_EMPTY;
+	u32 entry_index = 0;
+	for (; entry_index < entries_count && entries[entry_index].name[0]; entry_index++) {
+		if (entries[entry_index].name[0] == 0xE5) {
+			if (run_start == INDEX_SLOT_EMPTY) {
+				run_start = entry_index;
+			}
+			continue;
+		}
+
+		if (run_start != INDEX_SLOT_EMPTY) {
+			if (out_index->free_runs_count == free_runs_capacity) {
+				free_runs_capacity = free_runs_capacity ? free_runs_capacity * 2 : 16;
+				out_index->free_runs = realloc(out_index->free_runs, free_runs_capacity * sizeof(directory_free_run));
+			}
+			directory_free_run *run = &out_index->free_runs[out_index->free_runs_count++];
+			run->entry_index = run_start;
+			run->entries_count = entry_index - run_start;
+			run_start = INDEX_SLOT_EMPTY;
+		}
+	}
+
+	// deleted entries right before the end are part of the free space at the end
+	out_index->end_entry_index = run_start != INDEX_SLOT_EMPTY ? run_start : entry_index;
+}
+
+void directory_build_index(void *ptr, u32 size, directory_index *out_index) {
+	u32 files_count = directory_count_files(ptr, size);
+	u32 slots_count = 16;
+	while (slots_count < files_count * 2) {
+		slots_count *= 2;
+	}
+	s_allocate_index_slots(out_index, slots_count);
+
+	out_index->keys_capacity = 1024;
+	out_index->keys = malloc(out_index->keys_capacity);
+	out_index->keys_size = 0;
+	out_index->keys_count = 0;
+
+	file_info fi;
+	u32 entry_index = 0;
+	while (directory_next_file(ptr, size, &entry_index, &fi)) {
+		char key[MAX_FILENAME_UTF8_LEN + 1];
+		directory_fold_name(fi.filename, key);
+		u32 hash = s_hash_key(key);
+
+		// first file with the same name wins, like in a linear search
+		u32 slot_index = s_find_index_slot(out_index, hash, key);
+		if (out_index->slots[slot_index].key_offset == INDEX_SLOT_EMPTY) {
+			s_add_index_key(out_index, slot_index, hash, key, fi.entry_index);
+		}
+	}
+
+	s_build_free_entries_map(ptr, size, out_index);
+}
+
+void directory_free_index(directory_index *index) {
+	free(index->slots);
+	free(index->keys);
+	free(index->free_runs);
+	index->slots = NULL;
+	index->keys = NULL;
+	index->free_runs = NULL;
+	index->slots_count = 0;
+	index->keys_size = 0;
+	index->keys_count = 0;
+	index->free_runs_count = 0;
+}
+
+bool directory_find_file(void *ptr, u32 size, directory_index *index, file_info *out_file_info, char* name) {
+	char key[MAX_FILENAME_UTF8_LEN + 1];
+	if (strlen(name) > MAX_FILENAME_UTF8_LEN) {
+		return FALSE;
+	}
+	directory_fold_name(name, key);
+
+	directory_index_slot *slot = &index->slots[s_find_index_slot(index, s_hash_key(key), key)];
+	if (slot->key_offset == INDEX_SLOT_EMPTY) {
+		return FALSE;
+	}
+
+	u32 entry_index = slot->entry_index;
+	return directory_next_file(ptr, size, &entry_index, out_file_info);
+}
+
+u32 directory_find_free_entries(directory_index *index, u32 entries_count) {
+	// free space at the end of directory is used as the last resort,
+	// because directory has to be extended with new clusters there
+	for (u32 i = 0; i < index->free_runs_count; i++) {
+		if (index->free_runs[i].entries_count >= entries_count) {
+			return index->free_runs[i].entry_index;
+		}
+	}
+	return index->end_entry_index;
+}
+
+void directory_index_add_file(directory_index *index, char *name, u32 entry_index, u32 entries_count) {
+	if (entry_index >= index->end_entry_index) {
+		index->end_entry_index = entry_index + entries_count;
+	} else {
+		for (u32 i = 0; i < index->free_runs_count; i++) {
+			directory_free_run *run = &index->free_runs[i];
+			if (run->entry_index != entry_index) {
+				continue;
+			}
+
+			run->entry_index += entries_count;
+			run->entries_count -= entries_count;
+			if (!run->entries_count) {
+				index->free_runs_count--;
+				memmove(run, run + 1, (index->free_runs_count - i) * sizeof(directory_free_run));
+			}
+			break;
+		}
+	}
+
+	// table is kept at most half full, otherwise it's rebuilt with twice as many slots
+	if ((index->keys_count + 1) * 2 > index->slots_count) {
+		directory_index_slot *old_slots = index->slots;
+		u32 old_slots_count = index->slots_count;
+		s_allocate_index_slots(index, old_slots_count * 2);
+		for (u32 i = 0; i < old_slots_count; i++) {
+			if (old_slots[i].key_offset != INDEX_SLOT_EMPTY) {
+				u32 slot_index = s_find_index_slot(index, old_slots[i].hash, index->keys + old_slots[i].key_offset);
+				index->slots[slot_index] = old_slots[i];
+			}
+		}
+		free(old_slots);
+	}
+
+	char key[MAX_FILENAME_UTF8_LEN + 1];
+	directory_fold_name(name, key);
+	u32 hash = s_hash_key(key);
+	u32 slot_index = s_find_index_slot(index, hash, key);
+	if (index->slots[slot_index].key_offset == INDEX_SLOT_EMPTY) {
+		s_add_index_key(index, slot_index, hash, key, entry_index);
+	}
+}
+
+bool directory_is_valid_name(char *name) {
+	if (!name[0] || strlen(name) > MAX_FILENAME_UTF8_LEN) {
+		return FALSE;
+	}
+
+	for (u8 *name_ptr = (u8*) name; *name_ptr; name_ptr++) {
+		if (*name_ptr < 0x20 || strchr("\"*/:<>?\\|", *name_ptr)) {
+			return FALSE;
+		}
+	}
+
+	u16 utf16_name[MAX_FILENAME_LEN + 1];
+	return s_convert_utf8_to_utf16(name, utf16_name, MAX_FILENAME_LEN + 1) <= MAX_FILENAME_LEN;
 }
 
 u32 directory_calculate_dir_entry_size(char *directory_name) {
@@ -181,15 +644,26 @@ u32 directory_calculate_dir_entry_size(char *directory_name) {
 	return required_dir_entries * sizeof(dir_entry);
 }
 
-void* directory_find_free_entry(void *ptr, u32 size) {
+u32 directory_compact(void *ptr, u32 size) {
 	dir_entry *end_ptr = (dir_entry*) ((u8*) ptr + size);
+	dir_entry *write_ptr = ptr;
 	for (dir_entry *current_entry = ptr; current_entry < end_ptr; current_entry++) {
-		if (!current_entry->name[0]) {
-			return current_entry;
+		u8 first_byte = current_entry->name[0];
+		if (!first_byte) {
+			break;
+		} else if (first_byte == 0xE5) {
+			continue;
 		}
+
+		if (write_ptr != current_entry) {
+			memcpy(write_ptr, current_entry, sizeof(dir_entry));
+		}
+		write_ptr++;
 	}
 
-	return NULL;
+	u32 used_size = (u8*) write_ptr - (u8*) ptr;
+	memset(write_ptr, 0, size - used_size);
+	return used_size;
 }
 
 void directory_generate_sfn(void *ptr, u32 size, char* name, char* out_sfn) {
@@ -202,13 +676,13 @@ void directory_generate_sfn(void *ptr, u32 size, char* name, char* out_sfn) {
 			break;
 		}
 
-		if (name_ptr[i] == ' ') {
+		if (name_ptr[i] == ' ' || s_is_utf8_continuation_byte(name_ptr[i])) {
 			name_ptr += 1;
 			i--;
 			continue;
 		}
 
-		out_sfn[i] = toupper(name_ptr[i]);
+		out_sfn[i] = s_to_sfn_char(name_ptr[i]);
 	}
 
 	char *dot_ptr = strchr(name, '.');
@@ -218,7 +692,14 @@ void directory_generate_sfn(void *ptr, u32 size, char* name, char* out_sfn) {
 			if (!dot_ptr[i]) {
 				break;
 			}
-			out_sfn[8 + i] = toupper(dot_ptr[i]);
+
+			if (s_is_utf8_continuation_byte(dot_ptr[i])) {
+				dot_ptr += 1;
+				i--;
+				continue;
+			}
+
+			out_sfn[8 + i] = s_to_sfn_char(dot_ptr[i]);
 		}
 	}
 
@@ -254,12 +735,14 @@ void directory_generate_dir_entry(void *buffer, char *directory_name, char *dire
 	u8 checksum = s_sfn_checksum(directory_sfn);
 	u8 ord_counter = s_calculate_lfn_entries_count(directory_name);
 
+	u16 utf16_name[MAX_FILENAME_LEN];
+	u32 name_length = s_convert_utf8_to_utf16(directory_name, utf16_name, MAX_FILENAME_LEN);
+
 	long_dir_entry *long_entry = buffer;
-	s_fill_long_dir_entry(long_entry++, LAST_LONG_ENTRY | ord_counter--, checksum, directory_name);
+	s_fill_long_dir_entry(long_entry++, LAST_LONG_ENTRY | ord_counter--, checksum, utf16_name, name_length);
 
-	u32 remained_length = strlen(directory_name);
 	while (ord_counter > 0) {
-		s_fill_long_dir_entry(long_entry++, ord_counter--, checksum, directory_name);
+		s_fill_long_dir_entry(long_entry++, ord_counter--, checksum, utf16_name, name_length);
 	}
 
 	dir_entry *short_entry = (dir_entry*) long_entry;
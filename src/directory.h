@@ -3,22 +3,81 @@
 
 #include "types.h"
 
-#define MAX_FILENAME_LEN 255
+#define MAX_FILENAME_LEN 255 // in UTF-16 characters
+#define MAX_FILENAME_UTF8_LEN (MAX_FILENAME_LEN * 3) // every UTF-16 character takes at most 3 bytes in UTF-8
 #define SFN_LEN 11
 #define NEW_DIRECTORY_ENTRIES_SIZE 64
+#define INDEX_SLOT_EMPTY 0xFFFFFFFF
 
 typedef struct {
-	char filename[MAX_FILENAME_LEN + 1];
+	char filename[MAX_FILENAME_UTF8_LEN + 1];
 	u32 file_size;
 	u32 first_cluster;
 	bool is_directory;
+	u32 entry_index; // index of the first directory entry of the file, including LFN entries
+	u32 entries_count; // count of directory entries of the file, including LFN entries
 } file_info;
 
+typedef struct {
+	u32 name_offset; // offset of NULL terminated name inside listing's names
+	u32 name_length;
+	u32 file_size;
+	u32 first_cluster;
+	bool is_directory;
+} directory_listing_entry;
+
+// whole directory decoded into one allocation: fixed size entries followed by names of all entries
+typedef struct {
+	directory_listing_entry *entries;
+	u32 entries_count;
+	char *names;
+	u32 names_size;
+} directory_listing;
+
+typedef struct {
+	bool sort_by_name;
+	u32 page_offset; // index of the first returned entry
+	u32 page_size; // 0 means all entries after page_offset
+} directory_listing_options;
+
+typedef struct {
+	u32 hash; // hash of case folded name
+	u32 entry_index; // index of the first entry of the file, passed to directory_next_file to get it
+	u32 key_offset; // offset of case folded name inside keys buffer
+} directory_index_slot;
+
+typedef struct {
+	u32 entry_index;
+	u32 entries_count;
+} directory_free_run;
+
+// hash table of case folded file names, built once per directory, so lookups don't need to decode and fold every entry
+// free entries map is built together with it, so new entries are placed without scanning the directory
+typedef struct {
+	directory_index_slot *slots; // open addressing, unused slots have key_offset == INDEX_SLOT_EMPTY
+	u32 slots_count; // power of 2
+	u32 keys_count; // count of used slots
+	char *keys;
+	u32 keys_size;
+	u32 keys_capacity;
+	directory_free_run *free_runs; // runs of deleted entries in directory order
+	u32 free_runs_count;
+	u32 end_entry_index; // this entry and every entry after it are free
+} directory_index;
+
 int directory_count_files(void *ptr, int size);
 bool directory_next_file(void *ptr, u32 size, u32 *out_current_entry_index, file_info *out_file_info);
-bool directory_find_file(void *ptr, u32 size, file_info *out_file_info, char* name);
+void directory_read_listing(void *ptr, u32 size, directory_listing_options *options, directory_listing *out_listing);
+void directory_free_listing(directory_listing *listing);
+void directory_fold_name(char *name, char *out_key);
+void directory_build_index(void *ptr, u32 size, directory_index *out_index);
+void directory_free_index(directory_index *index);
+bool directory_find_file(void *ptr, u32 size, directory_index *index, file_info *out_file_info, char* name);
+bool directory_is_valid_name(char *name);
 u32 directory_calculate_dir_entry_size(char *directory_name);
-void* directory_find_free_entry(void *ptr, u32 size);
+u32 directory_find_free_entries(directory_index *index, u32 entries_count);
+void directory_index_add_file(directory_index *index, char *name, u32 entry_index, u32 entries_count);
+u32 directory_compact(void *ptr, u32 size);
 void directory_generate_dir_entry(void *buffer, char *directory_name, char *directory_sfn, u32 first_cluster);
 void directory_generate_sfn(void *ptr, u32 size, char* name, char* out_sfn);
 void directory_generate_new_folder_dir_entries(void *buffer, u32 current_cluster, u32 parent_cluster);
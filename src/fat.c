@@ -1,36 +1,215 @@
+#define _GNU_SOURCE // copy_file_range, fallocate hole punching and O_DIRECT
+
 #include "fat.h"
 #include "directory.h"
+#include "fat32_dir_entry.h"
 #include "fat32_reserved_area.h"
+#include "trace.h"
+#include "tar.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #define ROOT_DIR_CLUSTER 2
 #define END_OF_CHAIN_CLUSTER 0x0FFFFFF8
 #define CLUSTER_NUMBER_MASK 0x0FFFFFFF
+#define IO_BUFFER_SIZE (1024 * 1024) // size of pooled buffers, used for copying and for unaligned direct I/O
+#define IO_BUFFER_POOL_SIZE 4
+#define IO_ALIGNMENT 4096 // used when block size of the image can't be found out, page size is a multiple of logical block size of any common device
+#define FS_INFO_LEAD_SIGNATURE 0x41615252
+#define FS_INFO_STRUCTURE_SIGNATURE 0x61417272
+#define FS_INFO_UNKNOWN_FREE_COUNT 0xFFFFFFFF
+#define DIRECTORY_INDEX_CACHE_SIZE 8
+#define LISTING_LINE_MAX_OVERHEAD 64 // length of listing line without file name
+#define MAX_TREE_DEPTH 256 // protects recursive walks from loops in damaged directory trees
+#define ARCHIVE_WINDOW_SIZE (1024 * 1024) // max amount of file data sent or buffered at once
+#define ARCHIVE_BUFFER_SIZE (64 * 1024) // tar headers are collected here, so small files don't need separate writes
+#define ARCHIVE_MAX_PATH_LEN ((MAX_TREE_DEPTH + 2) * (MAX_FILENAME_UTF8_LEN + 1)) // archived directory and every nested level
+
+typedef struct {
+	u32 directory_cluster; // 0 when cache entry is unused
+	directory_index index;
+} cached_directory_index;
+
+typedef struct {
+	int fd;
+	u8 buffer[ARCHIVE_BUFFER_SIZE];
+	u32 size;
+	u8 *window; // allocated only when sendfile can't be used
+	char *path; // path of the current entry, names are appended and removed while walking the tree
+	u8 *headers; // tar headers of the current entry
+	bool is_failed;
+	bool is_incomplete; // some entries were skipped
+} archive_writer;
+
+typedef struct {
+	u32 *clusters;
+	u32 count;
+	u32 capacity;
+} cluster_list;
 
 static u32 s_cluster_size = 0; // cluster size in bytes
 static u32 s_first_data_sector = 0; // number of first data sector
-static FILE *s_fat_file = NULL;
+static int s_fat_fd = -1;
+static bool s_is_direct_io = FALSE; // image is opened with O_DIRECT, offsets, sizes and buffers should be aligned
+static u32 s_io_alignment = IO_ALIGNMENT; // logical block size of the device, or preferred I/O size of the file
+static u64 s_image_size = 0;
+static void *s_io_buffer_pool[IO_BUFFER_POOL_SIZE]; // free aligned buffers, so direct I/O doesn't allocate every time
+static u32 s_io_buffer_pool_count = 0;
 static fat_boot_sector s_boot_sector;
 static u32 *s_fat = NULL; // pointer to fat itself
 static u32 s_current_directory_cluster = ROOT_DIR_CLUSTER;
 static void *s_allocated_cluster_buffer = NULL;
+static FILE *s_output = NULL; // stream where all command output goes, stdout by default
+static cached_directory_index s_directory_index_cache[DIRECTORY_INDEX_CACHE_SIZE];
+static u32 s_directory_index_cache_next = 0; // cache entry which is replaced next
 
 static u32 s_normalize_cluster_number(u32 raw_cluster_number) {
 	return (raw_cluster_number & CLUSTER_NUMBER_MASK) - 2;
 }
 
+static u64 s_get_cluster_offset(u32 raw_cluster_number) {
+	u64 data_offset = (u64) s_first_data_sector * s_boot_sector.sector_size;
+	return data_offset + (u64) s_normalize_cluster_number(raw_cluster_number) * s_cluster_size;
+}
+
+static void* s_acquire_io_buffer() {
+	if (s_io_buffer_pool_count) {
+		return s_io_buffer_pool[--s_io_buffer_pool_count];
+	}
+
+	void *buffer = NULL;
+	posix_memalign(&buffer, s_io_alignment, IO_BUFFER_SIZE);
+	return buffer;
+}
+
+static void s_release_io_buffer(void *buffer) {
+	if (s_io_buffer_pool_count < IO_BUFFER_POOL_SIZE) {
+		s_io_buffer_pool[s_io_buffer_pool_count++] = buffer;
+	} else {
+		free(buffer);
+	}
+}
+
+static void s_free_io_buffer_pool() {
+	while (s_io_buffer_pool_count) {
+		free(s_io_buffer_pool[--s_io_buffer_pool_count]);
+	}
+}
+
+static bool s_pread_all(u64 offset, void *buffer, u32 size) {
+	u8 *buffer_ptr = buffer;
+	while (size > 0) {
+		ssize_t read_size = pread(s_fat_fd, buffer_ptr, size, offset);
+		if (read_size <= 0) {
+			return FALSE;
+		}
+		buffer_ptr += read_size;
+		offset += read_size;
+		size -= read_size;
+	}
+	return TRUE;
+}
+
+static bool s_pwrite_all(u64 offset, void *data, u32 size) {
+	u8 *data_ptr = data;
+	while (size > 0) {
+		ssize_t written = pwrite(s_fat_fd, data_ptr, size, offset);
+		if (written <= 0) {
+			return FALSE;
+		}
+		data_ptr += written;
+		offset += written;
+		size -= written;
+	}
+	return TRUE;
+}
+
+static bool s_is_aligned(u64 offset, void *buffer, u32 size) {
+	return ((offset | (uintptr_t) buffer | size) & (s_io_alignment - 1)) == 0;
+}
+
+// direct I/O of unaligned range goes through pooled aligned buffer, writes read partially covered blocks first
+static bool s_transfer_unaligned(u64 offset, u8 *data, u32 size, bool is_write) {
+	u64 end_offset = offset + size;
+	u8 *io_buffer = s_acquire_io_buffer();
+	bool success = TRUE;
+	while (size > 0 && success) {
+		u64 aligned_offset = offset & ~(u64) (s_io_alignment - 1);
+		u32 head_size = offset - aligned_offset;
+		u32 chunk_size = IO_BUFFER_SIZE - head_size;
+		if (chunk_size > size) {
+			chunk_size = size;
+		}
+		u32 aligned_size = (head_size + chunk_size + s_io_alignment - 1) & ~(s_io_alignment - 1);
+
+		if (!is_write) {
+			memset(io_buffer, 0, aligned_size);
+			success = pread(s_fat_fd, io_buffer, aligned_size, aligned_offset) >= 0;
+			memcpy(data, io_buffer + head_size, chunk_size);
+		} else {
+			u32 last_block_offset = aligned_size - s_io_alignment;
+			memset(io_buffer, 0, aligned_size);
+			if (head_size) {
+				success = pread(s_fat_fd, io_buffer, s_io_alignment, aligned_offset) >= 0;
+			}
+			if (success && (head_size + chunk_size) != aligned_size && (last_block_offset || !head_size)) {
+				success = pread(s_fat_fd, io_buffer + last_block_offset, s_io_alignment, aligned_offset + last_block_offset) >= 0;
+			}
+			memcpy(io_buffer + head_size, data, chunk_size);
+			success = success && s_pwrite_all(aligned_offset, io_buffer, aligned_size);
+		}
+
+		offset += chunk_size;
+		data += chunk_size;
+		size -= chunk_size;
+	}
+	s_release_io_buffer(io_buffer);
+
+	// last block of the image file can be partial, so padding written after the end of the image is cut off,
+	// size of a block device is always a multiple of its block size
+	u64 aligned_end_offset = (end_offset + s_io_alignment - 1) & ~(u64) (s_io_alignment - 1);
+	if (is_write && aligned_end_offset > s_image_size) {
+		success = ftruncate(s_fat_fd, s_image_size) == 0 && success;
+	}
+	return success;
+}
+
+static bool s_read_image(u64 offset, void *buffer, u32 size) {
+	if (s_is_direct_io && !s_is_aligned(offset, buffer, size)) {
+		return s_transfer_unaligned(offset, buffer, size, FALSE);
+	}
+	return s_pread_all(offset, buffer, size);
+}
+
+static bool s_write_image(u64 offset, void *data, u32 size) {
+	bool success;
+	if (s_is_direct_io && !s_is_aligned(offset, data, size)) {
+		success = s_transfer_unaligned(offset, data, size, TRUE);
+	} else {
+		success = s_pwrite_all(offset, data, size);
+	}
+
+	if (!success) {
+		fprintf(s_output, "Can't write to the image: %s\n", strerror(errno));
+	}
+	return success;
+}
+
 static void s_read_sectors(u32 offset, u32 count, void *dst_buffer) {
-	fseek(s_fat_file, offset * s_boot_sector.sector_size, SEEK_SET);
-	fread(dst_buffer, s_boot_sector.sector_size, count, s_fat_file);
+	s_read_image((u64) offset * s_boot_sector.sector_size, dst_buffer, count * s_boot_sector.sector_size);
 }
 
 static void s_read_clusters_into_buffer(u32 raw_cluster_number, u32 count, void *dst_buffer) {
-	u32 cluster_number = s_normalize_cluster_number(raw_cluster_number);
-	fseek(s_fat_file, s_first_data_sector * s_boot_sector.sector_size + cluster_number * s_cluster_size, SEEK_SET);
-	fread(dst_buffer, s_cluster_size, count, s_fat_file);
+	s_read_image(s_get_cluster_offset(raw_cluster_number), dst_buffer, count * s_cluster_size);
 }
 
 static bool s_is_end_of_chain_cluster(u32 raw_cluster_number) {
@@ -54,7 +233,8 @@ static void* s_read_cluster_chain(u32 starting_cluster, u32 *out_cluster_count)
 		cluster_count++;
 	} while (!s_is_end_of_chain_cluster(current_cluster));
 
-	s_allocated_cluster_buffer = malloc(cluster_count * s_cluster_size);
+	// aligned buffer lets direct I/O read clusters without copying them
+	posix_memalign(&s_allocated_cluster_buffer, s_io_alignment, cluster_count * s_cluster_size);
 	current_cluster = starting_cluster;
 	for (int i = 0; i < cluster_count; i++, current_cluster = s_get_next_cluster_number(current_cluster)) {
 		u8 *buffer_ptr = ((u8*) s_allocated_cluster_buffer) + s_cluster_size * i;
@@ -65,24 +245,65 @@ static void* s_read_cluster_chain(u32 starting_cluster, u32 *out_cluster_count)
 	return s_allocated_cluster_buffer;
 }
 
+static directory_index* s_get_directory_index(u32 directory_cluster, void *directory_clusters, u32 size) {
+	for (int i = 0; i < DIRECTORY_INDEX_CACHE_SIZE; i++) {
+		if (s_directory_index_cache[i].directory_cluster == directory_cluster) {
+			return &s_directory_index_cache[i].index;
+		}
+	}
+
+	cached_directory_index *cache_entry = &s_directory_index_cache[s_directory_index_cache_next];
+	s_directory_index_cache_next = (s_directory_index_cache_next + 1) % DIRECTORY_INDEX_CACHE_SIZE;
+	if (cache_entry->directory_cluster) {
+		directory_free_index(&cache_entry->index);
+	}
+
+	cache_entry->directory_cluster = directory_cluster;
+	directory_build_index(directory_clusters, size, &cache_entry->index);
+	return &cache_entry->index;
+}
+
+// should be called every time directory entries are modified
+static void s_invalidate_directory_index(u32 directory_cluster) {
+	for (int i = 0; i < DIRECTORY_INDEX_CACHE_SIZE; i++) {
+		if (s_directory_index_cache[i].directory_cluster == directory_cluster) {
+			directory_free_index(&s_directory_index_cache[i].index);
+			s_directory_index_cache[i].directory_cluster = 0;
+		}
+	}
+}
+
+// name lookup is case insensitive
+static bool s_find_file(u32 directory_cluster, void *directory_clusters, u32 cluster_count, file_info *out_file_info, char *name) {
+	u32 size = s_cluster_size * cluster_count;
+	directory_index *index = s_get_directory_index(directory_cluster, directory_clusters, size);
+	return directory_find_file(directory_clusters, size, index, out_file_info, name);
+}
+
 static u32 s_get_cluster_from_path(char *path, u32 starting_cluster) {
 	u32 current_cluster = starting_cluster;
 	file_info fi;
 	u32 cluster_count;
 
-	char searched_directory[MAX_FILENAME_LEN + 1];
+	char searched_directory[MAX_FILENAME_UTF8_LEN + 1];
 	char *path_ptr = path;
 
 	while (path_ptr[0]) {
 		char *slash_ptr = strchr(path_ptr, '/');
 		if (slash_ptr) {
 			int searched_directory_len = slash_ptr - path_ptr;
+			if (searched_directory_len > MAX_FILENAME_UTF8_LEN) {
+				return 0;
+			}
 			memcpy(searched_directory, path_ptr, searched_directory_len);
 			searched_directory[searched_directory_len] = 0;
 
 			path_ptr = slash_ptr + 1;
 		} else {
-			int remaining_len = strlen(path_ptr);			
+			int remaining_len = strlen(path_ptr);
+			if (remaining_len > MAX_FILENAME_UTF8_LEN) {
+				return 0;
+			}
 			memcpy(searched_directory, path_ptr, remaining_len);
 			searched_directory[remaining_len] = 0;
 
@@ -90,7 +311,7 @@ static u32 s_get_cluster_from_path(char *path, u32 starting_cluster) {
 		}
 
 		void *directory_clusters = s_read_cluster_chain(current_cluster, &cluster_count);
-		bool directory_exists = directory_find_file(directory_clusters, s_cluster_size * cluster_count, &fi, searched_directory);
+		bool directory_exists = s_find_file(current_cluster, directory_clusters, cluster_count, &fi, searched_directory);
 		if (!directory_exists || !fi.is_directory) {
 			return 0;
 		}
@@ -106,6 +327,21 @@ static u32 s_get_cluster_from_path(char *path, u32 starting_cluster) {
 	return current_cluster;
 }
 
+// free clusters count in FSInfo is only a hint, but it should be kept in sync with FAT
+static void s_update_fs_info_free_count(s32 free_clusters_delta) {
+	fs_info info;
+	u64 info_offset = (u64) s_boot_sector.info_sector * s_boot_sector.sector_size;
+	s_read_image(info_offset, &info, sizeof(info));
+
+	bool is_valid = info.lead_signature == FS_INFO_LEAD_SIGNATURE && info.structure_signature == FS_INFO_STRUCTURE_SIGNATURE;
+	if (!is_valid || info.free_cluster_count == FS_INFO_UNKNOWN_FREE_COUNT) {
+		return;
+	}
+
+	info.free_cluster_count += free_clusters_delta;
+	s_write_image(info_offset, &info, sizeof(info));
+}
+
 static u32 s_find_free_cluster() {
 	u32 *end_ptr = (u32*) ((u8*) s_fat + s_boot_sector.sector_size * s_boot_sector.fat32_length);
 	for (u32 *fat_entry = s_fat; fat_entry < end_ptr; fat_entry++) {
@@ -116,9 +352,7 @@ static u32 s_find_free_cluster() {
 }
 
 static void s_write_to_cluster(u32 raw_cluster_number, void* data, u32 size) {
-	u32 normalized_cluster_number = s_normalize_cluster_number(raw_cluster_number);
-	fseek(s_fat_file, s_first_data_sector * s_boot_sector.sector_size + normalized_cluster_number * s_cluster_size, SEEK_SET);
-	fwrite(data, size, 1, s_fat_file);
+	s_write_image(s_get_cluster_offset(raw_cluster_number), data, size);
 }
 
 static u32 s_modify_cluster_in_fat(u32 raw_cluster_number, u32 new_value) {
@@ -126,11 +360,10 @@ static u32 s_modify_cluster_in_fat(u32 raw_cluster_number, u32 new_value) {
 	new_value = (new_value & 0x0FFFFFFF) | last_4bits; // last 4 bits shouldn't be modified
 	s_fat[raw_cluster_number & CLUSTER_NUMBER_MASK] = new_value;
 
-	u32 byte_offset_to_fat_entry = (raw_cluster_number & CLUSTER_NUMBER_MASK) * sizeof(u32);
+	u64 byte_offset_to_fat_entry = (raw_cluster_number & CLUSTER_NUMBER_MASK) * sizeof(u32);
 	for (int i = 0; i < s_boot_sector.fats; i++) {
-		u32 offset = s_boot_sector.fat32_length * s_boot_sector.sector_size * i + byte_offset_to_fat_entry;
-		fseek(s_fat_file, s_boot_sector.reserved_sectors * s_boot_sector.sector_size + offset, SEEK_SET);
-		fwrite(&new_value, sizeof(new_value), 1, s_fat_file);
+		u64 offset = (u64) s_boot_sector.fat32_length * s_boot_sector.sector_size * i + byte_offset_to_fat_entry;
+		s_write_image((u64) s_boot_sector.reserved_sectors * s_boot_sector.sector_size + offset, &new_value, sizeof(new_value));
 	}	
 
 	return new_value;
@@ -140,62 +373,463 @@ static u32 s_add_new_cluster_to_chain(u32 raw_cluster_number) {
 	u32 free_cluster = s_find_free_cluster();
 	s_modify_cluster_in_fat(raw_cluster_number, free_cluster);
 	s_modify_cluster_in_fat(free_cluster, END_OF_CHAIN_CLUSTER);
+	s_update_fs_info_free_count(-1);
+
+	// new cluster might contain data of deleted files, directories expect it to be zeroed
+	u8 zeroed_cluster[s_cluster_size];
+	memset(zeroed_cluster, 0, s_cluster_size);
+	s_write_to_cluster(free_cluster, zeroed_cluster, s_cluster_size);
+
 	return free_cluster;
 }
 
+static u32 s_get_next_or_new_cluster_number(u32 raw_cluster_number) {
+	u32 next_cluster = s_get_next_cluster_number(raw_cluster_number);
+	if (s_is_end_of_chain_cluster(next_cluster)) {
+		return s_add_new_cluster_to_chain(raw_cluster_number);
+	}
+	return next_cluster;
+}
+
+// offset is counted from the start of the chain, chain is extended when data doesn't fit in it
 static void s_append_to_cluster(u32 raw_cluster_number, u32 offset, void *data, u32 size) {
-	u32 normalized_cluster_number = s_normalize_cluster_number(raw_cluster_number);
-	fseek(s_fat_file, s_first_data_sector * s_boot_sector.sector_size + normalized_cluster_number * s_cluster_size + offset, SEEK_SET);
-	if ((offset + size) <= s_cluster_size) {
-		fwrite(data, size, 1, s_fat_file);
+	u32 current_cluster = raw_cluster_number;
+	while (offset >= s_cluster_size) {
+		current_cluster = s_get_next_or_new_cluster_number(current_cluster);
+		offset -= s_cluster_size;
+	}
+
+	u8 *data_ptr = data;
+	while (1) {
+		u32 write_size = s_cluster_size - offset;
+		if (write_size > size) {
+			write_size = size;
+		}
+
+		s_write_image(s_get_cluster_offset(current_cluster) + offset, data_ptr, write_size);
+		data_ptr += write_size;
+		size -= write_size;
+		offset = 0;
+
+		if (!size) {
+			break;
+		}
+		current_cluster = s_get_next_or_new_cluster_number(current_cluster);
+	}
+}
+
+static void s_cluster_list_add(cluster_list *list, u32 cluster) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 1024;
+		list->clusters = realloc(list->clusters, list->capacity * sizeof(u32));
+	}
+	list->clusters[list->count++] = cluster;
+}
+
+static int s_compare_clusters(const void *first, const void *second) {
+	u32 first_cluster = *(u32*) first;
+	u32 second_cluster = *(u32*) second;
+	return first_cluster < second_cluster ? -1 : first_cluster > second_cluster;
+}
+
+static u32 s_get_fat_entries_count() {
+	// FAT can be bigger than the data area, so entries past the last data cluster are ignored
+	u32 fat_entries_count = s_boot_sector.sector_size * s_boot_sector.fat32_length / sizeof(u32);
+	u32 data_clusters_count = (s_boot_sector.total_sectors - s_first_data_sector) / s_boot_sector.sectors_per_cluster;
+	if (data_clusters_count + 2 < fat_entries_count) {
+		return data_clusters_count + 2;
+	}
+	return fat_entries_count;
+}
+
+static bool s_is_cluster_allocated(u32 raw_cluster_number) {
+	return (s_fat[raw_cluster_number & CLUSTER_NUMBER_MASK] & CLUSTER_NUMBER_MASK) != 0;
+}
+
+// returns how many clusters starting from first_cluster have the same allocation state
+static u32 s_get_cluster_run_length(u32 first_cluster, u32 fat_entries_count) {
+	bool allocated = s_is_cluster_allocated(first_cluster);
+	u32 cluster = first_cluster;
+	while (cluster < fat_entries_count && s_is_cluster_allocated(cluster) == allocated) {
+		cluster++;
+	}
+	return cluster - first_cluster;
+}
+
+// copies range of the image into the same range of dst_fd
+static bool s_copy_file_range(int dst_fd, u64 offset, u64 size) {
+	loff_t src_offset = offset;
+	loff_t dst_offset = offset;
+	while (size > 0) {
+		ssize_t copied = copy_file_range(s_fat_fd, &src_offset, dst_fd, &dst_offset, size, 0);
+		if (copied <= 0) {
+			break;
+		}
+		size -= copied;
+	}
+
+	if (size == 0) {
+		return TRUE;
+	}
+
+	// copy_file_range isn't supported between these files, fallback to regular copy
+	u8 *buffer = s_acquire_io_buffer();
+	while (size > 0) {
+		u32 chunk_size = size > IO_BUFFER_SIZE ? IO_BUFFER_SIZE : size;
+		if (!s_read_image(src_offset, buffer, chunk_size) || pwrite(dst_fd, buffer, chunk_size, dst_offset) != chunk_size) {
+			break;
+		}
+		src_offset += chunk_size;
+		dst_offset += chunk_size;
+		size -= chunk_size;
+	}
+	s_release_io_buffer(buffer);
+
+	return size == 0;
+}
+
+static u32 s_get_cluster_chain_length(u32 first_cluster) {
+	u32 fat_entries_count = s_get_fat_entries_count();
+	u32 current_cluster = first_cluster & CLUSTER_NUMBER_MASK;
+	u32 chain_length = 0; // chain of damaged FAT can loop, but it can't be longer than FAT itself
+	while (current_cluster >= ROOT_DIR_CLUSTER && current_cluster < fat_entries_count && s_is_cluster_allocated(current_cluster) && chain_length < fat_entries_count) {
+		chain_length++;
+		current_cluster = s_get_next_cluster_number(current_cluster) & CLUSTER_NUMBER_MASK;
+	}
+	return chain_length;
+}
+
+static void s_collect_cluster_chain(u32 first_cluster, cluster_list *out_clusters) {
+	u32 fat_entries_count = s_get_fat_entries_count();
+	u32 current_cluster = first_cluster & CLUSTER_NUMBER_MASK;
+	u32 chain_length = 0; // chain of damaged FAT can loop, but it can't be longer than FAT itself
+	while (current_cluster >= ROOT_DIR_CLUSTER && current_cluster < fat_entries_count && s_is_cluster_allocated(current_cluster) && chain_length < fat_entries_count) {
+		s_cluster_list_add(out_clusters, current_cluster);
+		chain_length++;
+		current_cluster = s_get_next_cluster_number(current_cluster) & CLUSTER_NUMBER_MASK;
+	}
+}
+
+// collects clusters of all files inside directory, including subdirectories
+// returns FALSE if tree is too deep, then nothing should be freed
+static bool s_collect_directory_tree(u32 directory_cluster, cluster_list *out_clusters, u32 depth) {
+	if (depth == MAX_TREE_DEPTH) {
+		return FALSE;
+	}
+
+	// directory is decoded into listing, because reading cluster chain of subdirectory replaces current buffer
+	u32 cluster_count;
+	void *directory_clusters = s_read_cluster_chain(directory_cluster, &cluster_count);
+	directory_listing listing;
+	directory_listing_options options = { FALSE, 0, 0 };
+	directory_read_listing(directory_clusters, s_cluster_size * cluster_count, &options, &listing);
+
+	bool is_collected = TRUE;
+	for (u32 i = 0; i < listing.entries_count && is_collected; i++) {
+		directory_listing_entry *entry = &listing.entries[i];
+		char *name = listing.names + entry->name_offset;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+
+		s_collect_cluster_chain(entry->first_cluster, out_clusters);
+		if (entry->is_directory && entry->first_cluster >= ROOT_DIR_CLUSTER) {
+			s_invalidate_directory_index(entry->first_cluster);
+			is_collected = s_collect_directory_tree(entry->first_cluster, out_clusters, depth + 1);
+		}
+	}
+
+	directory_free_listing(&listing);
+	return is_collected;
+}
+
+// frees all clusters in the list, every modified FAT sector is written once to every FAT
+// returns how many clusters were freed, cross-linked chains can list the same cluster more than once
+static u32 s_free_clusters(cluster_list *clusters) {
+	qsort(clusters->clusters, clusters->count, sizeof(u32), s_compare_clusters);
+	u32 unique_count = 0;
+	for (u32 i = 0; i < clusters->count; i++) {
+		if (unique_count == 0 || clusters->clusters[unique_count - 1] != clusters->clusters[i]) {
+			clusters->clusters[unique_count++] = clusters->clusters[i];
+		}
+	}
+	clusters->count = unique_count;
+
+	for (u32 i = 0; i < clusters->count; i++) {
+		s_fat[clusters->clusters[i]] &= ~CLUSTER_NUMBER_MASK; // last 4 bits shouldn't be modified
+	}
+
+	u32 entries_per_sector = s_boot_sector.sector_size / sizeof(u32);
+	u32 i = 0;
+	while (i < clusters->count) {
+		// consecutive modified sectors are written at once
+		u32 first_sector = clusters->clusters[i] / entries_per_sector;
+		u32 last_sector = first_sector;
+		while (i < clusters->count && clusters->clusters[i] / entries_per_sector <= last_sector + 1) {
+			last_sector = clusters->clusters[i] / entries_per_sector;
+			i++;
+		}
+
+		u32 sectors_count = last_sector - first_sector + 1;
+		u8 *sectors_ptr = (u8*) s_fat + first_sector * s_boot_sector.sector_size;
+		for (int fat_number = 0; fat_number < s_boot_sector.fats; fat_number++) {
+			u32 fat_first_sector = s_boot_sector.reserved_sectors + s_boot_sector.fat32_length * fat_number;
+			u64 offset = (u64) (fat_first_sector + first_sector) * s_boot_sector.sector_size;
+			s_write_image(offset, sectors_ptr, s_boot_sector.sector_size * sectors_count);
+		}
+	}
+
+	s_update_fs_info_free_count(clusters->count);
+	return clusters->count;
+}
+
+static bool s_write_all(int fd, void *data, u32 size) {
+	u8 *data_ptr = data;
+	while (size > 0) {
+		ssize_t written = write(fd, data_ptr, size);
+		if (written <= 0) {
+			return FALSE;
+		}
+		data_ptr += written;
+		size -= written;
+	}
+	return TRUE;
+}
+
+static void s_archive_flush(archive_writer *writer) {
+	if (writer->size && !writer->is_failed) {
+		writer->is_failed = !s_write_all(writer->fd, writer->buffer, writer->size);
+	}
+	writer->size = 0;
+}
+
+static void s_archive_write(archive_writer *writer, void *data, u32 size) {
+	if (writer->size + size > ARCHIVE_BUFFER_SIZE) {
+		s_archive_flush(writer);
+	}
+	// headers of deeply nested entries don't fit into the buffer
+	if (size > ARCHIVE_BUFFER_SIZE) {
+		if (!writer->is_failed) {
+			writer->is_failed = !s_write_all(writer->fd, data, size);
+		}
 		return;
 	}
+	memcpy(writer->buffer + writer->size, data, size);
+	writer->size += size;
+}
+
+// sends contiguous part of the image, data goes from image to output inside kernel when possible
+static void s_archive_send_extent(archive_writer *writer, u64 offset, u64 size) {
+	s_archive_flush(writer);
+
+	while (size > 0 && !writer->is_failed) {
+		u32 chunk_size = size > ARCHIVE_WINDOW_SIZE ? ARCHIVE_WINDOW_SIZE : size;
+
+		if (!writer->window) {
+			off_t sendfile_offset = offset;
+			ssize_t sent = sendfile(writer->fd, s_fat_fd, &sendfile_offset, chunk_size);
+			if (sent > 0) {
+				offset += sent;
+				size -= sent;
+				continue;
+			}
+			if (sent == 0 || (errno != EINVAL && errno != ENOSYS)) {
+				writer->is_failed = TRUE;
+				break;
+			}
+			writer->window = s_acquire_io_buffer(); // sendfile isn't supported for this output or image
+		}
+
+		if (!s_read_image(offset, writer->window, chunk_size) || !s_write_all(writer->fd, writer->window, chunk_size)) {
+			writer->is_failed = TRUE;
+			break;
+		}
+		offset += chunk_size;
+		size -= chunk_size;
+	}
+}
 
-	u32 first_write_size = s_cluster_size - offset;
-	fwrite(data, first_write_size, 1, s_fat_file);
+static void s_archive_file(archive_writer *writer, directory_listing_entry *entry) {
+	u32 headers_size = tar_fill_headers(writer->headers, writer->path, entry->file_size, FALSE);
+	s_archive_write(writer, writer->headers, headers_size);
 
-	u32 remaining_size = size - first_write_size;
-	u32 current_cluster = raw_cluster_number;
+	// contiguous clusters are sent as one extent
+	u32 fat_entries_count = s_get_fat_entries_count();
+	u32 current_cluster = entry->first_cluster;
+	u64 remaining_size = entry->file_size;
+	while (remaining_size > 0 && current_cluster >= ROOT_DIR_CLUSTER && current_cluster < fat_entries_count) {
+		u32 extent_first_cluster = current_cluster;
+		u64 extent_size = 0;
+		u32 next_cluster;
+		do {
+			extent_size += s_cluster_size;
+			next_cluster = s_get_next_cluster_number(current_cluster) & CLUSTER_NUMBER_MASK;
+			if (next_cluster != current_cluster + 1 || extent_size >= remaining_size) {
+				break;
+			}
+			current_cluster = next_cluster;
+		} while (TRUE);
+
+		if (extent_size > remaining_size) {
+			extent_size = remaining_size;
+		}
+		s_archive_send_extent(writer, s_get_cluster_offset(extent_first_cluster), extent_size);
+		remaining_size -= extent_size;
+		current_cluster = next_cluster;
+	}
+
+	// chain is shorter than file size, archive should still be readable
+	u8 zeroes[TAR_BLOCK_SIZE] = { 0 };
 	while (remaining_size > 0) {
-		current_cluster = s_add_new_cluster_to_chain(current_cluster);
-		fseek(s_fat_file, s_first_data_sector * s_boot_sector.sector_size + current_cluster * s_cluster_size, SEEK_SET);
+		u32 zeroes_size = remaining_size > TAR_BLOCK_SIZE ? TAR_BLOCK_SIZE : remaining_size;
+		s_archive_write(writer, zeroes, zeroes_size);
+		remaining_size -= zeroes_size;
+	}
 
-		u8 *data_ptr = (u8*) data + (size - remaining_size);
-		if (remaining_size > s_cluster_size) {
-			fwrite(data_ptr, s_cluster_size, 1, s_fat_file);
-			remaining_size -= s_cluster_size;
-		} else {
-			fwrite(data_ptr, remaining_size, 1, s_fat_file);
-			remaining_size = 0;
+	s_archive_write(writer, zeroes, tar_get_padding_size(entry->file_size));
+}
+
+// writer's path should end with '/', unless it's empty, which means root of the archive
+static void s_archive_directory(archive_writer *writer, u32 directory_cluster, u32 depth) {
+	if (depth == MAX_TREE_DEPTH) {
+		fprintf(stderr, "Directory tree is too deep, skipping contents of %s\n", writer->path);
+		writer->is_incomplete = TRUE;
+		return;
+	}
+
+	u32 cluster_count;
+	void *directory_clusters = s_read_cluster_chain(directory_cluster, &cluster_count);
+	directory_listing listing;
+	directory_listing_options options = { FALSE, 0, 0 };
+	directory_read_listing(directory_clusters, s_cluster_size * cluster_count, &options, &listing);
+
+	// path buffer fits a name on every level up to MAX_TREE_DEPTH
+	char *path_end = writer->path + strlen(writer->path);
+	for (u32 i = 0; i < listing.entries_count && !writer->is_failed; i++) {
+		directory_listing_entry *entry = &listing.entries[i];
+		char *name = listing.names + entry->name_offset;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
 		}
+
+		sprintf(path_end, "%s%s", name, entry->is_directory ? "/" : "");
+		if (!entry->is_directory) {
+			s_archive_file(writer, entry);
+			continue;
+		}
+
+		s_archive_write(writer, writer->headers, tar_fill_headers(writer->headers, writer->path, 0, TRUE));
+		if (entry->first_cluster >= ROOT_DIR_CLUSTER) {
+			s_archive_directory(writer, entry->first_cluster, depth + 1);
+		}
+	}
+	*path_end = 0;
+
+	directory_free_listing(&listing);
+}
+
+// st_size is 0 for block devices, so their size is asked from the device itself
+static u64 s_get_image_size() {
+	struct stat image_stat;
+	fstat(s_fat_fd, &image_stat);
+	if (!S_ISBLK(image_stat.st_mode)) {
+		return image_stat.st_size;
 	}
+
+	u64 device_size;
+	if (ioctl(s_fat_fd, BLKGETSIZE64, &device_size) == 0) {
+		return device_size;
+	}
+	return (u64) s_boot_sector.total_sectors * s_boot_sector.sector_size;
 }
 
-bool fat_load_from_file(char *filepath) {
-	s_fat_file = fopen(filepath, "rb+");
-	if (!s_fat_file) {
+// direct I/O needs offsets, sizes and buffers aligned to logical block size of the device,
+// for files it's found out from preferred I/O size, which is a multiple of block size of the filesystem
+static u32 s_get_io_alignment() {
+	struct stat image_stat;
+	fstat(s_fat_fd, &image_stat);
+
+	int block_size = 0;
+	if (S_ISBLK(image_stat.st_mode)) {
+		if (ioctl(s_fat_fd, BLKSSZGET, &block_size) != 0) {
+			block_size = 0;
+		}
+	} else {
+		block_size = image_stat.st_blksize;
+	}
+
+	// pooled buffers should consist of whole blocks
+	bool is_power_of_two = block_size > 0 && (block_size & (block_size - 1)) == 0;
+	if (!is_power_of_two || block_size > IO_BUFFER_SIZE) {
+		return IO_ALIGNMENT;
+	}
+	return block_size;
+}
+
+bool fat_load_from_file(char *filepath, bool is_direct_io) {
+	int fat_fd = open(filepath, O_RDWR | (is_direct_io ? O_DIRECT : 0));
+	if (fat_fd < 0) {
 		return FALSE;
 	}
 
-	fread(&s_boot_sector, sizeof(s_boot_sector), 1, s_fat_file);
+	// another image might be already loaded, its state is dropped
+	if (s_fat_fd >= 0) {
+		close(s_fat_fd);
+		free(s_fat);
+		for (int i = 0; i < DIRECTORY_INDEX_CACHE_SIZE; i++) {
+			if (s_directory_index_cache[i].directory_cluster) {
+				s_invalidate_directory_index(s_directory_index_cache[i].directory_cluster);
+			}
+		}
+	}
+
+	s_fat_fd = fat_fd;
+	s_is_direct_io = is_direct_io;
+	s_io_alignment = s_get_io_alignment();
+	s_output = stdout;
+	s_current_directory_cluster = ROOT_DIR_CLUSTER;
+
+	s_read_image(0, &s_boot_sector, sizeof(s_boot_sector));
 	s_cluster_size = s_boot_sector.sector_size * s_boot_sector.sectors_per_cluster;
 	s_first_data_sector = s_boot_sector.reserved_sectors + s_boot_sector.fats * s_boot_sector.fat32_length;
+	if (s_boot_sector.sector_size > s_io_alignment) {
+		s_io_alignment = s_boot_sector.sector_size;
+	}
+	s_free_io_buffer_pool(); // pooled buffers might be aligned for another image
+	s_image_size = s_get_image_size();
 
-	s_fat = (u32*) malloc(s_boot_sector.sector_size * s_boot_sector.fat32_length);
+	// FAT is allocated aligned, so it can be read and written directly in direct I/O mode
+	u32 fat_size = s_boot_sector.sector_size * s_boot_sector.fat32_length;
+	u32 aligned_fat_size = (fat_size + s_io_alignment - 1) & ~(s_io_alignment - 1);
+	posix_memalign((void**) &s_fat, s_io_alignment, aligned_fat_size);
 	s_read_sectors(s_boot_sector.reserved_sectors, s_boot_sector.fat32_length, s_fat);
 
 	return TRUE;
 }
 
-bool fat_change_current_directory(char *path) {
-	u32 directory_cluster = 0;
+void fat_set_output(FILE *output) {
+	s_output = output;
+}
+
+u32 fat_get_current_directory() {
+	return s_current_directory_cluster;
+}
+
+void fat_set_current_directory(u32 directory_cluster) {
+	s_current_directory_cluster = directory_cluster;
+}
+
+u32 fat_find_directory(char *path) {
 	bool is_path_absolute = path[0] == '/';
 	if (is_path_absolute) {
-		directory_cluster = s_get_cluster_from_path(path + 1, ROOT_DIR_CLUSTER);
-	} else {
-		directory_cluster = s_get_cluster_from_path(path, s_current_directory_cluster);
+		return s_get_cluster_from_path(path + 1, ROOT_DIR_CLUSTER);
 	}
 
+	return s_get_cluster_from_path(path, s_current_directory_cluster);
+}
+
+static bool s_change_current_directory(char *path) {
+	u32 directory_cluster = fat_find_directory(path);
 	if (!directory_cluster) {
 		return FALSE;
 	}
@@ -205,43 +839,57 @@ bool fat_change_current_directory(char *path) {
 	return TRUE;
 }
 
-void fat_print_current_directory_files() {
-	u32 current_entry_index = 0;
-	file_info fi;
+static void s_print_directory_listing(u32 directory_cluster, directory_listing_options *options) {
 	u32 cluster_count;
 
-	void *directory_clusters = s_read_cluster_chain(s_current_directory_cluster, &cluster_count);
-	while (directory_next_file(directory_clusters, s_cluster_size * cluster_count, &current_entry_index, &fi)) {
-		printf("%s| %s | Size: %d, Cluster: %d\n", fi.is_directory ? "DIR" : "FILE", fi.filename, fi.file_size, fi.first_cluster);
+	void *directory_clusters = s_read_cluster_chain(directory_cluster, &cluster_count);
+	directory_listing listing;
+	directory_read_listing(directory_clusters, s_cluster_size * cluster_count, options, &listing);
+
+	// whole listing is formatted into one buffer, so it's written with a single call
+	char *output = malloc(listing.names_size + listing.entries_count * LISTING_LINE_MAX_OVERHEAD + 2);
+	u32 output_size = 0;
+	for (u32 i = 0; i < listing.entries_count; i++) {
+		directory_listing_entry *entry = &listing.entries[i];
+		char *name = listing.names + entry->name_offset;
+		output_size += sprintf(output + output_size, "%s| %s | Size: %u, Cluster: %u\n", entry->is_directory ? "DIR" : "FILE", name, entry->file_size, entry->first_cluster);
 	}
-	printf("\n");
+	output[output_size++] = '\n';
+
+	fwrite(output, 1, output_size, s_output);
+	free(output);
+	directory_free_listing(&listing);
+}
+
+static void s_print_current_directory_files(bool sort_by_name, u32 page_offset, u32 page_size) {
+	directory_listing_options options = { sort_by_name, page_offset, page_size };
+	s_print_directory_listing(s_current_directory_cluster, &options);
 }
 
 void fat_print_directory_files(char *absolute_path) {
 	if (absolute_path[0] != '/') {
-		printf("Incorrect path format\n");
+		fprintf(s_output, "Incorrect path format\n");
+		return;
 	}
 
 	u32 directory_cluster = s_get_cluster_from_path(absolute_path + 1, ROOT_DIR_CLUSTER);
-	u32 current_entry_index = 0;
-	file_info fi;
-	u32 cluster_count;
-
-	void *directory_clusters = s_read_cluster_chain(directory_cluster, &cluster_count);
-	while (directory_next_file(directory_clusters, s_cluster_size * cluster_count, &current_entry_index, &fi)) {
-		printf("%s| %s | Size: %d, Cluster: %d\n", fi.is_directory ? "DIR" : "FILE", fi.filename, fi.file_size, fi.first_cluster);
+	if (!directory_cluster) {
+		fprintf(s_output, "Can't find specified directory\n");
+		return;
 	}
-	printf("\n");
+
+	directory_listing_options options = { FALSE, 0, 0 };
+	s_print_directory_listing(directory_cluster, &options);
 }
 
-void fat_print_file_content(char *filename) {
+static void s_print_file_content(char *filename) {
 	u32 cluster_count;
 	file_info fi;
 
 	void *directory_clusters = s_read_cluster_chain(s_current_directory_cluster, &cluster_count);
-	bool file_exists = directory_find_file(directory_clusters, s_cluster_size * cluster_count, &fi, filename);
+	bool file_exists = s_find_file(s_current_directory_cluster, directory_clusters, cluster_count, &fi, filename);
 	if (!file_exists || fi.is_directory) {
-		printf("Can't find specified file\n");
+		fprintf(s_output, "Can't find specified file\n");
 		return;
 	}
 
@@ -253,10 +901,10 @@ void fat_print_file_content(char *filename) {
 		if (remaining_size >= s_cluster_size) {
 			file_content_buffer[s_cluster_size] = 0;
 			remaining_size -= s_cluster_size;
-			printf(file_content_buffer);
+			fputs((char*) file_content_buffer, s_output);
 		} else {
 			file_content_buffer[remaining_size] = 0;
-			printf(file_content_buffer);
+			fputs((char*) file_content_buffer, s_output);
 			remaining_size = 0;
 		}
 
@@ -267,44 +915,343 @@ void fat_print_file_content(char *filename) {
 		current_cluster = s_get_next_cluster_number(current_cluster);
 	} while (remaining_size);
 
-	printf("\n");
+	fprintf(s_output, "\n");
 }
 
-void fat_create_directory(char* directory_name) {
+static void s_print_file_info(char *name) {
 	u32 cluster_count;
 	file_info fi;
 
 	void *directory_clusters = s_read_cluster_chain(s_current_directory_cluster, &cluster_count);
-	if (directory_find_file(directory_clusters, s_cluster_size * cluster_count, &fi, directory_name)) {
-		printf("File or directory with the same name already exists\n");
+	if (!s_find_file(s_current_directory_cluster, directory_clusters, cluster_count, &fi, name)) {
+		fprintf(s_output, "Can't find specified file\n");
+		return;
+	}
+
+	u32 chain_length = s_get_cluster_chain_length(fi.first_cluster);
+	fprintf(s_output, "Name: %s\n", fi.filename);
+	fprintf(s_output, "Type: %s\n", fi.is_directory ? "DIR" : "FILE");
+	fprintf(s_output, "Size: %u\n", fi.file_size);
+	fprintf(s_output, "Cluster: %u\n", fi.first_cluster);
+	fprintf(s_output, "Clusters: %u (%llu bytes)\n", chain_length, (unsigned long long) chain_length * s_cluster_size);
+}
+
+static void s_create_directory(char* directory_name) {
+	u32 cluster_count;
+	file_info fi;
+
+	if (!directory_is_valid_name(directory_name)) {
+		fprintf(s_output, "Invalid directory name\n");
+		return;
+	}
+
+	void *directory_clusters = s_read_cluster_chain(s_current_directory_cluster, &cluster_count);
+	if (s_find_file(s_current_directory_cluster, directory_clusters, cluster_count, &fi, directory_name)) {
+		fprintf(s_output, "File or directory with the same name already exists\n");
 		return;
 	}
 
 	char directory_sfn[SFN_LEN];
 	directory_generate_sfn(directory_clusters, s_cluster_size * cluster_count, directory_name, directory_sfn);
 
-	u32 current_cluster = s_current_directory_cluster;
-	u32 next_cluster = s_current_directory_cluster;
-	do {
-		current_cluster = next_cluster;
-		next_cluster = s_get_next_cluster_number(current_cluster);
-	} while (!s_is_end_of_chain_cluster(next_cluster));
-
 	u32 new_directory_entry_size = directory_calculate_dir_entry_size(directory_name);	
 	u8 new_directory_entry[new_directory_entry_size];
 
 	u32 new_directory_first_cluster = s_find_free_cluster();
 	s_modify_cluster_in_fat(new_directory_first_cluster, END_OF_CHAIN_CLUSTER);
+	s_update_fs_info_free_count(-1);
 	directory_generate_dir_entry(new_directory_entry, directory_name, directory_sfn, new_directory_first_cluster);
 
-	u8 cluster_buffer[s_cluster_size];
-	s_read_clusters_into_buffer(current_cluster, 1, cluster_buffer);
-	u8 *free_space_ptr = directory_find_free_entry(cluster_buffer, s_cluster_size);
-	u32 write_offset = free_space_ptr - cluster_buffer;
+	// deleted entries are reused when there's a long enough run of them
+	directory_index *index = s_get_directory_index(s_current_directory_cluster, directory_clusters, s_cluster_size * cluster_count);
+	u32 new_directory_entries_count = new_directory_entry_size / sizeof(dir_entry);
+	u32 new_directory_entry_index = directory_find_free_entries(index, new_directory_entries_count);
+	u32 write_offset = new_directory_entry_index * sizeof(dir_entry);
+
+	s_append_to_cluster(s_current_directory_cluster, write_offset, new_directory_entry, new_directory_entry_size);
 
-	s_append_to_cluster(current_cluster, write_offset, new_directory_entry, new_directory_entry_size);
+	// index is updated instead of being rebuilt, name is decoded from the new entries to match how it's read later
+	file_info new_directory_info;
+	u32 new_entry_index = 0;
+	directory_next_file(new_directory_entry, new_directory_entry_size, &new_entry_index, &new_directory_info);
+	directory_index_add_file(index, new_directory_info.filename, new_directory_entry_index, new_directory_entries_count);
+
+	// ".." of directories inside root directory should point to cluster 0
+	u32 parent_cluster = s_current_directory_cluster == ROOT_DIR_CLUSTER ? 0 : s_current_directory_cluster;
+	u8 new_directory_data[s_cluster_size];
+	memset(new_directory_data, 0, s_cluster_size);
+	directory_generate_new_folder_dir_entries(new_directory_data, new_directory_first_cluster, parent_cluster);
+	s_write_to_cluster(new_directory_first_cluster, new_directory_data, s_cluster_size);
+}
+
+static void s_compact_current_directory() {
+	u32 cluster_count;
+
+	u8 *directory_clusters = s_read_cluster_chain(s_current_directory_cluster, &cluster_count);
+	u32 used_size = directory_compact(directory_clusters, s_cluster_size * cluster_count);
+	s_invalidate_directory_index(s_current_directory_cluster);
+	u32 used_cluster_count = used_size ? (used_size + s_cluster_size - 1) / s_cluster_size : 1;
+
+	u32 current_cluster = s_current_directory_cluster;
+	for (u32 i = 0; i < used_cluster_count; i++) {
+		if (i) {
+			current_cluster = s_get_next_cluster_number(current_cluster);
+		}
+		s_write_to_cluster(current_cluster, directory_clusters + s_cluster_size * i, s_cluster_size);
+	}
+
+	// clusters after the last used one aren't needed anymore
+	u32 next_cluster = s_get_next_cluster_number(current_cluster);
+	if (!s_is_end_of_chain_cluster(next_cluster)) {
+		s_modify_cluster_in_fat(current_cluster, END_OF_CHAIN_CLUSTER);
+	}
+	while (!s_is_end_of_chain_cluster(next_cluster)) {
+		u32 freed_cluster = next_cluster;
+		next_cluster = s_get_next_cluster_number(freed_cluster);
+		s_modify_cluster_in_fat(freed_cluster, 0);
+	}
+	s_update_fs_info_free_count(cluster_count - used_cluster_count);
 
-	u8 new_directory_data[NEW_DIRECTORY_ENTRIES_SIZE];
-	directory_generate_new_folder_dir_entries(new_directory_data, new_directory_first_cluster, current_cluster);
-	s_write_to_cluster(new_directory_first_cluster, new_directory_data, NEW_DIRECTORY_ENTRIES_SIZE);
+	fprintf(s_output, "Freed %u of %u directory clusters\n", cluster_count - used_cluster_count, cluster_count);
+}
+
+bool fat_clone_image(char *destination_path) {
+	u64 image_size = s_image_size;
+
+	// destination isn't truncated on open, because it can turn out to be the opened image itself
+	int dst_fd = open(destination_path, O_WRONLY | O_CREAT, 0644);
+	if (dst_fd < 0) {
+		fprintf(s_output, "Can't create destination image\n");
+		return FALSE;
+	}
+
+	struct stat image_stat;
+	fstat(s_fat_fd, &image_stat);
+	struct stat destination_stat;
+	fstat(dst_fd, &destination_stat);
+	bool is_same_file = destination_stat.st_dev == image_stat.st_dev && destination_stat.st_ino == image_stat.st_ino;
+	bool is_same_device = S_ISBLK(destination_stat.st_mode) && S_ISBLK(image_stat.st_mode) && destination_stat.st_rdev == image_stat.st_rdev;
+	if (is_same_file || is_same_device) {
+		fprintf(s_output, "Destination is the opened image\n");
+		close(dst_fd);
+		return FALSE;
+	}
+
+	// destination file is created with the full size, so every region that isn't copied stays a hole,
+	// block device can't be resized, so it's written as is
+	if (S_ISREG(destination_stat.st_mode) && (ftruncate(dst_fd, 0) != 0 || ftruncate(dst_fd, image_size) != 0)) {
+		fprintf(s_output, "Can't resize destination image\n");
+		close(dst_fd);
+		return FALSE;
+	}
+
+	// reserved area and all FATs are copied as is
+	u64 data_offset = (u64) s_first_data_sector * s_boot_sector.sector_size;
+	bool success = s_copy_file_range(dst_fd, 0, data_offset);
+
+	u32 fat_entries_count = s_get_fat_entries_count();
+	u32 copied_clusters_count = 0;
+	u32 cluster = ROOT_DIR_CLUSTER;
+	while (success && cluster < fat_entries_count) {
+		u32 run_length = s_get_cluster_run_length(cluster, fat_entries_count);
+		if (s_is_cluster_allocated(cluster)) {
+			success = s_copy_file_range(dst_fd, s_get_cluster_offset(cluster), (u64) run_length * s_cluster_size);
+			copied_clusters_count += run_length;
+		}
+		cluster += run_length;
+	}
+
+	// anything after the last data cluster isn't part of the filesystem, but it's kept anyway
+	u64 data_end_offset = s_get_cluster_offset(fat_entries_count);
+	if (success && data_end_offset < image_size) {
+		success = s_copy_file_range(dst_fd, data_end_offset, image_size - data_end_offset);
+	}
+
+	// close reports delayed write errors, like running out of space
+	if (close(dst_fd) != 0 || !success) {
+		fprintf(s_output, "Failed to copy image data\n");
+		return FALSE;
+	}
+
+	fprintf(s_output, "Copied %u of %u clusters\n", copied_clusters_count, fat_entries_count - ROOT_DIR_CLUSTER);
+	return TRUE;
+}
+
+void fat_trim_image() {
+	u32 fat_entries_count = s_get_fat_entries_count();
+	u32 trimmed_clusters_count = 0;
+	u32 cluster = ROOT_DIR_CLUSTER;
+	while (cluster < fat_entries_count) {
+		u32 run_length = s_get_cluster_run_length(cluster, fat_entries_count);
+		if (!s_is_cluster_allocated(cluster)) {
+			int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+			if (fallocate(s_fat_fd, mode, s_get_cluster_offset(cluster), (u64) run_length * s_cluster_size) != 0) {
+				fprintf(s_output, "Can't punch holes in the image: %s\n", strerror(errno));
+				return;
+			}
+			trimmed_clusters_count += run_length;
+		}
+		cluster += run_length;
+	}
+
+	fprintf(s_output, "Trimmed %u free clusters\n", trimmed_clusters_count);
+}
+
+static void s_remove(char *name) {
+	u32 cluster_count;
+	file_info fi;
+
+	u8 *directory_clusters = s_read_cluster_chain(s_current_directory_cluster, &cluster_count);
+	if (!s_find_file(s_current_directory_cluster, directory_clusters, cluster_count, &fi, name)) {
+		fprintf(s_output, "Can't find specified file\n");
+		return;
+	}
+
+	if (strcmp(fi.filename, ".") == 0 || strcmp(fi.filename, "..") == 0) {
+		fprintf(s_output, "Can't remove current or parent directory\n");
+		return;
+	}
+
+	// clusters are collected before anything is modified, so too deep tree doesn't leave lost clusters
+	cluster_list clusters = { NULL, 0, 0 };
+	s_collect_cluster_chain(fi.first_cluster, &clusters);
+	if (fi.is_directory && fi.first_cluster >= ROOT_DIR_CLUSTER) {
+		s_invalidate_directory_index(fi.first_cluster);
+		if (!s_collect_directory_tree(fi.first_cluster, &clusters, 0)) {
+			fprintf(s_output, "Directory tree is too deep\n");
+			free(clusters.clusters);
+			return;
+		}
+
+		// reading subdirectories replaced cluster buffer
+		directory_clusters = s_read_cluster_chain(s_current_directory_cluster, &cluster_count);
+	}
+
+	// LFN and SFN entries are marked as deleted, and every modified cluster of the directory is written once
+	u32 first_entry_offset = fi.entry_index * sizeof(dir_entry);
+	u32 last_entry_offset = (fi.entry_index + fi.entries_count - 1) * sizeof(dir_entry);
+	for (u32 i = 0; i < fi.entries_count; i++) {
+		directory_clusters[first_entry_offset + i * sizeof(dir_entry)] = 0xE5;
+	}
+
+	u32 current_cluster = s_current_directory_cluster;
+	for (u32 i = 0; i <= last_entry_offset / s_cluster_size; i++) {
+		if (i >= first_entry_offset / s_cluster_size) {
+			s_write_to_cluster(current_cluster, directory_clusters + i * s_cluster_size, s_cluster_size);
+		}
+		current_cluster = s_get_next_cluster_number(current_cluster);
+	}
+	s_invalidate_directory_index(s_current_directory_cluster);
+
+	u32 freed_clusters_count = s_free_clusters(&clusters);
+	fprintf(s_output, "Freed %u clusters\n", freed_clusters_count);
+	free(clusters.clusters);
+}
+
+// entry points below record every call into the trace when recording is enabled
+
+bool fat_change_current_directory(char *path) {
+	u64 start_time = trace_get_time();
+	bool result = s_change_current_directory(path);
+	trace_record_operation(start_time, "cd", path);
+	return result;
+}
+
+void fat_print_current_directory_files(bool sort_by_name, u32 page_offset, u32 page_size) {
+	u64 start_time = trace_get_time();
+	s_print_current_directory_files(sort_by_name, page_offset, page_size);
+
+	if (trace_is_recording()) {
+		char argument[64];
+		sprintf(argument, "%u %u %u", sort_by_name, page_offset, page_size);
+		trace_record_operation(start_time, "ls", argument);
+	}
+}
+
+void fat_print_file_content(char *filename) {
+	u64 start_time = trace_get_time();
+	s_print_file_content(filename);
+	trace_record_operation(start_time, "read", filename);
+}
+
+void fat_print_file_info(char *name) {
+	u64 start_time = trace_get_time();
+	s_print_file_info(name);
+	trace_record_operation(start_time, "stat", name);
+}
+
+void fat_create_directory(char* directory_name) {
+	u64 start_time = trace_get_time();
+	s_create_directory(directory_name);
+	trace_record_operation(start_time, "mkdir", directory_name);
+}
+
+void fat_compact_current_directory() {
+	u64 start_time = trace_get_time();
+	s_compact_current_directory();
+	trace_record_operation(start_time, "compact", "");
+}
+
+void fat_remove(char *name) {
+	u64 start_time = trace_get_time();
+	s_remove(name);
+	trace_record_operation(start_time, "rm", name);
+}
+
+bool fat_archive_directory(char *path, int output_fd) {
+	u32 directory_cluster = fat_find_directory(path);
+	if (!directory_cluster) {
+		fprintf(stderr, "Can't find specified directory\n");
+		return FALSE;
+	}
+
+	archive_writer *writer = malloc(sizeof(archive_writer));
+	writer->fd = output_fd;
+	writer->size = 0;
+	writer->window = NULL;
+	writer->path = malloc(ARCHIVE_MAX_PATH_LEN + 1);
+	writer->headers = malloc(TAR_GET_MAX_HEADERS_SIZE(ARCHIVE_MAX_PATH_LEN));
+	writer->is_failed = FALSE;
+	writer->is_incomplete = FALSE;
+
+	// files are stored inside a directory named like the archived one, root directory contents are stored as is
+	char *archive_path = writer->path;
+	archive_path[0] = 0;
+	u32 path_length = strlen(path);
+	while (path_length > 0 && path[path_length - 1] == '/') {
+		path_length--;
+	}
+	if (path_length > 0) {
+		char *name_ptr = path + path_length;
+		while (name_ptr > path && name_ptr[-1] != '/') {
+			name_ptr--;
+		}
+		u32 name_length = path + path_length - name_ptr;
+		memcpy(archive_path, name_ptr, name_length);
+		strcpy(archive_path + name_length, "/");
+	}
+
+	if (archive_path[0]) {
+		s_archive_write(writer, writer->headers, tar_fill_headers(writer->headers, archive_path, 0, TRUE));
+	}
+	s_archive_directory(writer, directory_cluster, 0);
+
+	// archive ends with two zeroed blocks
+	u8 end_blocks[TAR_BLOCK_SIZE * 2] = { 0 };
+	s_archive_write(writer, end_blocks, sizeof(end_blocks));
+	s_archive_flush(writer);
+
+	bool success = !writer->is_failed && !writer->is_incomplete;
+	if (writer->is_failed) {
+		fprintf(stderr, "Failed to write archive\n");
+	} else if (writer->is_incomplete) {
+		fprintf(stderr, "Archive is incomplete\n");
+	}
+	if (writer->window) {
+		s_release_io_buffer(writer->window);
+	}
+	free(writer->path);
+	free(writer->headers);
+	free(writer);
+	return success;
 }
@@ -3,11 +3,23 @@
 
 #include "types.h"
 
-bool fat_load_from_file(char *filepath);
+#include <stdio.h>
+
+bool fat_load_from_file(char *filepath, bool is_direct_io);
 void fat_print_directory_files(char *path);
+void fat_set_output(FILE *output);
+u32 fat_get_current_directory();
+void fat_set_current_directory(u32 directory_cluster);
+u32 fat_find_directory(char *path);
 bool fat_change_current_directory(char *path);
-void fat_print_current_directory_files();
+void fat_print_current_directory_files(bool sort_by_name, u32 page_offset, u32 page_size);
 void fat_print_file_content(char *filename);
+void fat_print_file_info(char *name);
 void fat_create_directory(char* directory_name);
+void fat_compact_current_directory();
+void fat_remove(char *name);
+bool fat_archive_directory(char *path, int output_fd);
+bool fat_clone_image(char *destination_path);
+void fat_trim_image();
 
 #endif
\ No newline at end of file
@@ -1,8 +1,45 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "fat.h"
 #include "shell.h"
+#include "daemon.h"
+#include "trace.h"
+
+// trace is replayed on a copy of the image, so the original image isn't modified and replay can be repeated,
+// copy is as big as the image, so it's created in TMPDIR unless another directory is given
+static bool s_replay_on_copy(char *trace_path, char *copy_directory, bool is_paced, bool is_direct_io) {
+	if (!copy_directory) {
+		copy_directory = getenv("TMPDIR");
+	}
+	if (!copy_directory || !copy_directory[0]) {
+		copy_directory = "/tmp";
+	}
+
+	char copy_path[4096];
+	snprintf(copy_path, sizeof(copy_path), "%s/fat32_replay-XXXXXX", copy_directory);
+	int copy_fd = mkstemp(copy_path);
+	if (copy_fd < 0) {
+		printf("Can't create image copy in %s!\n", copy_directory);
+		return FALSE;
+	}
+	close(copy_fd);
+
+	// clone messages aren't part of the replay report, but errors should still be visible
+	fat_set_output(stderr);
+	bool is_cloned = fat_clone_image(copy_path);
+	fat_set_output(stdout);
+
+	bool success = is_cloned;
+	if (success && !fat_load_from_file(copy_path, is_direct_io)) {
+		puts("Can't load image copy!");
+		success = FALSE;
+	}
+	success = success && trace_replay(trace_path, is_paced);
+	unlink(copy_path);
+	return success;
+}
 
 int main(int argc, char *argv[]) {
 	if (argc < 2) {
@@ -10,13 +47,107 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	char *fat_filename = argv[1];
+	if (strcmp(argv[1], "--connect") == 0) {
+		if (argc < 3) {
+			puts("No socket specified!");
+			return 1;
+		}
+		return daemon_run_client(argv[2]) ? 0 : 1;
+	}
+
+	// every image is served on its own socket, i-th socket belongs to i-th image
+	char *image_paths[DAEMON_MAX_IMAGES];
+	char *socket_paths[DAEMON_MAX_IMAGES];
+	u32 images_count = 0;
+	u32 sockets_count = 0;
+	char *record_path = NULL;
+	char *replay_path = NULL;
+	char *replay_directory = NULL;
+	char *archive_path = NULL;
+	bool is_paced = FALSE;
+	bool is_direct_io = FALSE;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			if (sockets_count < DAEMON_MAX_IMAGES) {
+				socket_paths[sockets_count] = argv[i + 1];
+			}
+			sockets_count++;
+			i++;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_path = argv[++i];
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay_path = argv[++i];
+		} else if (strcmp(argv[i], "--replay-dir") == 0 && i + 1 < argc) {
+			replay_directory = argv[++i];
+		} else if (strcmp(argv[i], "--archive") == 0 && i + 1 < argc) {
+			archive_path = argv[++i];
+		} else if (strcmp(argv[i], "--paced") == 0) {
+			is_paced = TRUE;
+		} else if (strcmp(argv[i], "--direct") == 0) {
+			is_direct_io = TRUE;
+		} else if (argv[i][0] != '-') {
+			if (images_count < DAEMON_MAX_IMAGES) {
+				image_paths[images_count] = argv[i];
+			}
+			images_count++;
+		}
+	}
+
+	if (images_count > DAEMON_MAX_IMAGES) {
+		printf("At most %d images can be opened!\n", DAEMON_MAX_IMAGES);
+		return 1;
+	}
+
+	if (images_count == 0) {
+		puts("No input file specified!");
+		return 1;
+	}
+
+	if (sockets_count) {
+		if (sockets_count != images_count) {
+			puts("Every served image needs its own socket!");
+			return 1;
+		}
+		if (replay_path || archive_path) {
+			puts("Served images can't be replayed or archived!");
+			return 1;
+		} else if (record_path && images_count > 1) {
+			puts("Only one served image can be recorded!");
+			return 1;
+		}
+		// served image is loaded by the daemon, loading doesn't get into the trace
+		if (record_path && !trace_start_recording(record_path)) {
+			puts("Can't create trace file!");
+			return 1;
+		}
+		return daemon_serve(image_paths, socket_paths, images_count, is_direct_io) ? 0 : 1;
+	}
+
+	if (images_count > 1) {
+		puts("Only one image can be opened in the shell!");
+		return 1;
+	}
+
+	char *fat_filename = image_paths[0];
+	if (!fat_load_from_file(fat_filename, is_direct_io)) {
+		return 1;
+	}
+
+	if (archive_path) {
+		return fat_archive_directory(archive_path, STDOUT_FILENO) ? 0 : 1;
+	}
+
+	if (replay_path) {
+		return s_replay_on_copy(replay_path, replay_directory, is_paced, is_direct_io) ? 0 : 1;
+	}
 
-	if (!fat_load_from_file(fat_filename)) {
+	if (record_path && !trace_start_recording(record_path)) {
+		puts("Can't create trace file!");
 		return 1;
 	}
 
 	run_shell();
+	trace_stop_recording();
 
 	return 0;
 }
@@ -1,10 +1,12 @@
 #include "shell.h"
 #include "fat.h"
+#include "trace.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-static char s_cwd[1024] = "/"; // current working directory
+static char s_cwd[SHELL_CWD_SIZE] = "/"; // current working directory
 
 static bool s_check_command(char* command, char* str) {
 	int i;
@@ -37,39 +39,102 @@ static bool s_check_command(char* command, char* str) {
 	return TRUE;
 }
 
-static void s_change_cwd(char *path) {
+static bool s_is_separator_needed(char *cwd, char *path) {
+	return path[0] != '/' && cwd[strlen(cwd) - 1] != '/';
+}
+
+// cwd buffer is SHELL_CWD_SIZE bytes, it's shared with daemon clients, so path can't be trusted to fit
+static bool s_is_cwd_fitting(char *cwd, char *path) {
+	u32 new_cwd_len = strlen(path) + s_is_separator_needed(cwd, path);
+	if (path[0] != '/') {
+		new_cwd_len += strlen(cwd);
+	}
+	return new_cwd_len < SHELL_CWD_SIZE;
+}
+
+static void s_change_cwd(char *cwd, char *path) {
 	if (path[0] == '/') {
-		strcpy(s_cwd, path);
+		strcpy(cwd, path);
 	} else {
-		int cwd_len = strlen(s_cwd);
-		if (s_cwd[cwd_len - 1] != '/') {
-			strcat(s_cwd, "/");
+		if (s_is_separator_needed(cwd, path)) {
+			strcat(cwd, "/");
 		}
 
-		strcat(s_cwd, path);
+		strcat(cwd, path);
 	}
 }
 
+// ls [-s] [<first entry> [<entries count>]]
+static void s_print_files(char *arguments) {
+	bool sort_by_name = FALSE;
+	u32 page_values[2] = { 0, 0 };
+	int page_values_count = 0;
+
+	for (char *argument = strtok(arguments, " "); argument; argument = strtok(NULL, " ")) {
+		if (strcmp(argument, "-s") == 0) {
+			sort_by_name = TRUE;
+		} else if (page_values_count < 2) {
+			page_values[page_values_count++] = strtoul(argument, NULL, 10);
+		}
+	}
+
+	fat_print_current_directory_files(sort_by_name, page_values[0], page_values[1]);
+}
+
+bool shell_execute_command(char *buffer, char *cwd, FILE *output, bool is_remote) {
+	if (s_check_command("exit", buffer)) {
+		return FALSE;
+	} else if (s_check_command("ls", buffer)) {
+		s_print_files(buffer);
+	} else if (s_check_command("cd", buffer)) {
+		if (!s_is_cwd_fitting(cwd, buffer)) {
+			fprintf(output, "Path is too long\n");
+		} else if (fat_change_current_directory(buffer)) {
+			s_change_cwd(cwd, buffer);
+		} else {
+			fprintf(output, "Can't find specified directory\n");
+		}
+	} else if (s_check_command("read", buffer)) {
+		fat_print_file_content(buffer);
+	} else if (s_check_command("stat", buffer)) {
+		fat_print_file_info(buffer);
+	} else if (s_check_command("mkdir", buffer)) {
+		fat_create_directory(buffer);
+	} else if (s_check_command("rm", buffer)) {
+		fat_remove(buffer);
+	} else if (s_check_command("compact", buffer)) {
+		fat_compact_current_directory();
+	} else if (is_remote && (s_check_command("record", buffer) || s_check_command("clone", buffer) || s_check_command("trim", buffer))) {
+		// daemon clients can't access files of the host or change how the image is stored
+		fprintf(output, "Command isn't available in daemon mode\n");
+	} else if (s_check_command("record", buffer)) {
+		if (!buffer[0]) {
+			trace_stop_recording();
+		} else if (trace_start_recording(buffer)) {
+			// replay starts from root directory, so the first recorded operation returns to the current one
+			fat_change_current_directory(cwd);
+		} else {
+			fprintf(output, "Can't create trace file\n");
+		}
+	} else if (s_check_command("clone", buffer)) {
+		fat_clone_image(buffer);
+	} else if (s_check_command("trim", buffer)) {
+		fat_trim_image();
+	}
+
+	return TRUE;
+}
+
 void run_shell() {
-	char buffer[1024];
+	char buffer[SHELL_LINE_SIZE];
 	while (1) {
 		printf("%s>", s_cwd);
-		fgets(buffer, sizeof(buffer), stdin);
+		if (!fgets(buffer, sizeof(buffer), stdin)) {
+			return;
+		}
 
-		if (s_check_command("exit", buffer)) {
+		if (!shell_execute_command(buffer, s_cwd, stdout, FALSE)) {
 			return;
-		} else if (s_check_command("ls", buffer)) {
-			fat_print_current_directory_files();
-		} else if (s_check_command("cd", buffer)) {
-			if (fat_change_current_directory(buffer)) {
-				s_change_cwd(buffer);
-			} else {
-				printf("Can't find specified directory\n");
-			}
-		} else if (s_check_command("read", buffer)) {
-			fat_print_file_content(buffer);
-		} else if (s_check_command("mkdir", buffer)) {
-			fat_create_directory(buffer);
 		}
 	}
 }
@@ -3,6 +3,12 @@
 
 #include "types.h"
 
+#include <stdio.h>
+
+#define SHELL_LINE_SIZE 1024
+#define SHELL_CWD_SIZE 1024
+
+bool shell_execute_command(char *buffer, char *cwd, FILE *output, bool is_remote);
 void run_shell();
 
 #endif
\ No newline at end of file
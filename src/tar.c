@@ -0,0 +1,118 @@
+#include "tar.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define USTAR_NAME_LEN 100
+#define USTAR_PREFIX_LEN 155
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_DIRECTORY '5'
+#define TAR_TYPE_PAX_HEADER 'x'
+
+typedef struct {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char type;
+	char link_name[100];
+	char magic[6]; // "ustar" with NULL terminating character
+	char version[2]; // "00"
+	char user_name[32];
+	char group_name[32];
+	char device_major[8];
+	char device_minor[8];
+	char prefix[155];
+	char padding[12];
+} __attribute__((packed)) ustar_header;
+
+static void s_fill_ustar_header(ustar_header *header, char *name, char *prefix, u64 size, char type) {
+	memset(header, 0, sizeof(ustar_header));
+	strncpy(header->name, name, sizeof(header->name));
+	strncpy(header->prefix, prefix, sizeof(header->prefix));
+	sprintf(header->mode, "%07o", type == TAR_TYPE_DIRECTORY ? 0755 : 0644);
+	sprintf(header->uid, "%07o", 0);
+	sprintf(header->gid, "%07o", 0);
+	sprintf(header->size, "%011llo", (unsigned long long) size);
+	sprintf(header->mtime, "%011o", 0);
+	header->type = type;
+	memcpy(header->magic, "ustar", 6);
+	memcpy(header->version, "00", 2);
+
+	// checksum is calculated as if checksum field was filled with spaces
+	memset(header->checksum, ' ', sizeof(header->checksum));
+	u32 checksum = 0;
+	for (u32 i = 0; i < sizeof(ustar_header); i++) {
+		checksum += ((u8*) header)[i];
+	}
+	sprintf(header->checksum, "%06o", checksum);
+	header->checksum[7] = ' ';
+}
+
+// splits path between name and prefix fields, returns FALSE if path doesn't fit in them
+static bool s_split_path(char *path, char *out_name, char *out_prefix) {
+	u32 path_length = strlen(path);
+	if (path_length <= USTAR_NAME_LEN) {
+		strcpy(out_name, path);
+		out_prefix[0] = 0;
+		return TRUE;
+	}
+
+	// prefix should end right before one of slashes, name is everything after that slash
+	for (char *slash_ptr = strchr(path, '/'); slash_ptr; slash_ptr = strchr(slash_ptr + 1, '/')) {
+		u32 prefix_length = slash_ptr - path;
+		u32 name_length = path_length - prefix_length - 1;
+		if (prefix_length <= USTAR_PREFIX_LEN && name_length <= USTAR_NAME_LEN && name_length > 0) {
+			memcpy(out_prefix, path, prefix_length);
+			out_prefix[prefix_length] = 0;
+			strcpy(out_name, slash_ptr + 1);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+u32 tar_fill_headers(void *buffer, char *path, u64 size, bool is_directory) {
+	char name[USTAR_NAME_LEN + 1];
+	char prefix[USTAR_PREFIX_LEN + 1];
+	u8 *buffer_ptr = buffer;
+	char type = is_directory ? TAR_TYPE_DIRECTORY : TAR_TYPE_FILE;
+
+	if (s_split_path(path, name, prefix)) {
+		s_fill_ustar_header((ustar_header*) buffer_ptr, name, prefix, size, type);
+		return TAR_BLOCK_SIZE;
+	}
+
+	// path is too long for ustar, it's stored in pax extended header as "<record length> path=<path>\n",
+	// where record length includes its own digits
+	u32 record_length = strlen(" path=\n") + strlen(path);
+	char length_digits[16];
+	int digits_count = sprintf(length_digits, "%u", record_length);
+	while (digits_count != sprintf(length_digits, "%u", record_length + digits_count)) {
+		digits_count++;
+	}
+	record_length += digits_count;
+
+	u32 pax_data_size = record_length + tar_get_padding_size(record_length);
+	s_fill_ustar_header((ustar_header*) buffer_ptr, "PaxHeader", "", record_length, TAR_TYPE_PAX_HEADER);
+	buffer_ptr += TAR_BLOCK_SIZE;
+	memset(buffer_ptr, 0, pax_data_size);
+	sprintf((char*) buffer_ptr, "%u path=%s\n", record_length, path);
+	buffer_ptr += pax_data_size;
+
+	// ustar header still gets truncated name for tools without pax support
+	strncpy(name, path, USTAR_NAME_LEN);
+	name[USTAR_NAME_LEN] = 0;
+	s_fill_ustar_header((ustar_header*) buffer_ptr, name, "", size, type);
+	buffer_ptr += TAR_BLOCK_SIZE;
+
+	return buffer_ptr - (u8*) buffer;
+}
+
+u32 tar_get_padding_size(u64 size) {
+	return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
@@ -0,0 +1,12 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include "types.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_GET_MAX_HEADERS_SIZE(path_length) (TAR_BLOCK_SIZE * 4 + (path_length)) // ustar header, optionally preceded by pax header with long path
+
+u32 tar_fill_headers(void *buffer, char *path, u64 size, bool is_directory);
+u32 tar_get_padding_size(u64 size);
+
+#endif
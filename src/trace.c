@@ -0,0 +1,199 @@
+#include "trace.h"
+#include "fat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MAX_OPERATION_LEN 16
+#define NANOSECONDS_IN_SECOND 1000000000ULL
+
+// every trace line is "<start time> <duration> <operation> <argument>", times are in nanoseconds
+// and start time is counted from the moment recording was started
+typedef struct {
+	u64 start_time;
+	char operation[TRACE_MAX_OPERATION_LEN + 1];
+	char argument[TRACE_MAX_ARGUMENT_LEN + 1];
+} trace_operation;
+
+typedef struct {
+	char *operation; // NULL for the summary of all operations
+	u64 *latencies;
+	u32 count;
+} latency_stats;
+
+static FILE *s_trace_file = NULL;
+static u64 s_recording_start_time = 0;
+
+static int s_compare_latencies(const void *first, const void *second) {
+	u64 first_latency = *(u64*) first;
+	u64 second_latency = *(u64*) second;
+	return first_latency < second_latency ? -1 : first_latency > second_latency;
+}
+
+static void s_sleep_until(u64 time) {
+	u64 current_time = trace_get_time();
+	if (current_time >= time) {
+		return;
+	}
+
+	u64 sleep_time = time - current_time;
+	struct timespec duration = { sleep_time / NANOSECONDS_IN_SECOND, sleep_time % NANOSECONDS_IN_SECOND };
+	nanosleep(&duration, NULL);
+}
+
+static void s_execute_operation(trace_operation *operation) {
+	char *argument = operation->argument;
+	if (strcmp(operation->operation, "cd") == 0) {
+		fat_change_current_directory(argument);
+	} else if (strcmp(operation->operation, "ls") == 0) {
+		u32 sort_by_name = 0, page_offset = 0, page_size = 0;
+		sscanf(argument, "%u %u %u", &sort_by_name, &page_offset, &page_size);
+		fat_print_current_directory_files(sort_by_name, page_offset, page_size);
+	} else if (strcmp(operation->operation, "read") == 0) {
+		fat_print_file_content(argument);
+	} else if (strcmp(operation->operation, "stat") == 0) {
+		fat_print_file_info(argument);
+	} else if (strcmp(operation->operation, "mkdir") == 0) {
+		fat_create_directory(argument);
+	} else if (strcmp(operation->operation, "rm") == 0) {
+		fat_remove(argument);
+	} else if (strcmp(operation->operation, "compact") == 0) {
+		fat_compact_current_directory();
+	}
+}
+
+static void s_print_latency_stats(latency_stats *stats) {
+	if (!stats->count) {
+		return;
+	}
+
+	qsort(stats->latencies, stats->count, sizeof(u64), s_compare_latencies);
+	u64 p50 = stats->latencies[(stats->count - 1) * 50 / 100];
+	u64 p90 = stats->latencies[(stats->count - 1) * 90 / 100];
+	u64 p99 = stats->latencies[(stats->count - 1) * 99 / 100];
+	u64 max = stats->latencies[stats->count - 1];
+	printf("%-8s %8u ops | p50: %8.1f us, p90: %8.1f us, p99: %8.1f us, max: %8.1f us\n",
+		stats->operation ? stats->operation : "all", stats->count, p50 / 1000.0, p90 / 1000.0, p99 / 1000.0, max / 1000.0);
+}
+
+bool trace_start_recording(char *trace_path) {
+	trace_stop_recording();
+
+	s_trace_file = fopen(trace_path, "w");
+	if (!s_trace_file) {
+		return FALSE;
+	}
+
+	// trace is line buffered, so it's complete even if process is killed (daemon mode runs until then)
+	setvbuf(s_trace_file, NULL, _IOLBF, 0);
+	s_recording_start_time = trace_get_time();
+	return TRUE;
+}
+
+void trace_stop_recording() {
+	if (s_trace_file) {
+		fclose(s_trace_file);
+		s_trace_file = NULL;
+	}
+}
+
+bool trace_is_recording() {
+	return s_trace_file != NULL;
+}
+
+u64 trace_get_time() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * NANOSECONDS_IN_SECOND + time.tv_nsec;
+}
+
+void trace_record_operation(u64 start_time, char *operation, char *argument) {
+	if (!s_trace_file) {
+		return;
+	}
+
+	u64 duration = trace_get_time() - start_time;
+	fprintf(s_trace_file, "%llu %llu %s %s\n", (unsigned long long) (start_time - s_recording_start_time), (unsigned long long) duration, operation, argument);
+}
+
+bool trace_replay(char *trace_path, bool is_paced) {
+	FILE *trace_file = fopen(trace_path, "r");
+	if (!trace_file) {
+		printf("Can't open trace file\n");
+		return FALSE;
+	}
+
+	// whole trace is parsed before replaying, so parsing doesn't affect measured time
+	u32 operations_capacity = 1024;
+	u32 operations_count = 0;
+	trace_operation *operations = malloc(operations_capacity * sizeof(trace_operation));
+
+	char line[TRACE_MAX_ARGUMENT_LEN + 64];
+	while (fgets(line, sizeof(line), trace_file)) {
+		line[strcspn(line, "\n")] = 0;
+
+		if (operations_count == operations_capacity) {
+			operations_capacity *= 2;
+			operations = realloc(operations, operations_capacity * sizeof(trace_operation));
+		}
+
+		trace_operation *operation = &operations[operations_count];
+		unsigned long long start_time;
+		int argument_position = 0;
+		if (sscanf(line, "%llu %*u %16s %n", &start_time, operation->operation, &argument_position) < 2) {
+			continue; // damaged line
+		}
+
+		operation->start_time = start_time;
+		strncpy(operation->argument, line + argument_position, TRACE_MAX_ARGUMENT_LEN);
+		operation->argument[TRACE_MAX_ARGUMENT_LEN] = 0;
+		operations_count++;
+	}
+	fclose(trace_file);
+
+	// output of replayed commands is not needed, only timings are reported
+	FILE *null_output = fopen("/dev/null", "w");
+	fat_set_output(null_output);
+
+	u64 *latencies = malloc((operations_count + 1) * sizeof(u64));
+	u64 replay_start_time = trace_get_time();
+	for (u32 i = 0; i < operations_count; i++) {
+		if (is_paced) {
+			s_sleep_until(replay_start_time + operations[i].start_time);
+		}
+
+		u64 start_time = trace_get_time();
+		s_execute_operation(&operations[i]);
+		latencies[i] = trace_get_time() - start_time;
+	}
+	u64 replay_time = trace_get_time() - replay_start_time;
+
+	fat_set_output(stdout);
+	fclose(null_output);
+
+	double replay_seconds = (double) replay_time / NANOSECONDS_IN_SECOND;
+	printf("Replayed %u operations in %.3f s, %.1f ops/s\n", operations_count, replay_seconds, replay_seconds > 0 ? operations_count / replay_seconds : 0);
+
+	// per operation stats, latencies of every operation are copied into a separate array
+	u64 *operation_latencies = malloc((operations_count + 1) * sizeof(u64));
+	char *operation_names[] = { "cd", "ls", "read", "stat", "mkdir", "rm", "compact" };
+	for (u32 name_index = 0; name_index < sizeof(operation_names) / sizeof(operation_names[0]); name_index++) {
+		latency_stats stats = { operation_names[name_index], operation_latencies, 0 };
+		for (u32 i = 0; i < operations_count; i++) {
+			if (strcmp(operations[i].operation, stats.operation) == 0) {
+				stats.latencies[stats.count++] = latencies[i];
+			}
+		}
+		s_print_latency_stats(&stats);
+	}
+
+	latency_stats all_stats = { NULL, latencies, operations_count };
+	s_print_latency_stats(&all_stats);
+
+	free(operation_latencies);
+	free(latencies);
+	free(operations);
+	return TRUE;
+}
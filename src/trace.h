@@ -0,0 +1,15 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+
+#define TRACE_MAX_ARGUMENT_LEN 1024
+
+bool trace_start_recording(char *trace_path);
+void trace_stop_recording();
+bool trace_is_recording();
+u64 trace_get_time();
+void trace_record_operation(u64 start_time, char *operation, char *argument);
+bool trace_replay(char *trace_path, bool is_paced);
+
+#endif